@@ -0,0 +1,134 @@
+/*
+ * Microbenchmarks for the MLFQ simulator
+ * --------------------------------------
+ * Builds mlfqsim.c in-place (without its main) and measures:
+ *
+ *   - q_push / q_pop cost in ns/op
+ *   - pick-next + requeue cost in ns/op with 10 .. 1M runnable processes,
+ *     once with everything in L0 and once with everything in L2 (the latter
+ *     also pays for skipping the empty higher levels)
+ *   - ticks per second of the whole engine with the trace off and on
+ *     (the trace is written to /dev/null)
+ *   - peak RSS of the benchmark process
+ *
+ * Results are printed as one JSON object on stdout so that runs can be
+ * stored and compared across versions:
+ *
+ *   make bench > bench.json
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define MLFQSIM_NO_MAIN
+#include "mlfqsim.c"
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+static double now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static bool first_result=true;
+
+static void result(const char *name, const char *variant, long long n, const char *unit, double value){
+  printf("%s\n    {\"name\": \"%s\", \"variant\": \"%s\", \"n\": %lld, \"%s\": %.3f}",
+         first_result ? "" : ",", name, variant, n, unit, value);
+  first_result=false;
+}
+
+// Repeat a measurement until it has run for at least this long.
+#define MIN_NS 2e8
+
+static void bench_queue(long long n){
+  proc_t *procs=calloc(n,sizeof *procs);
+  queue_t q={0};
+  double push_ns=0, pop_ns=0; long long ops=0;
+  while(push_ns+pop_ns < MIN_NS){
+    double t0=now_ns();
+    for(long long i=0;i<n;i++) q_push(&q,&procs[i]);
+    double t1=now_ns();
+    for(long long i=0;i<n;i++) if(!q_pop(&q)) abort();
+    double t2=now_ns();
+    push_ns+=t1-t0; pop_ns+=t2-t1; ops+=n;
+  }
+  result("q_push","",n,"ns_per_op",push_ns/ops);
+  result("q_pop","",n,"ns_per_op",pop_ns/ops);
+  free(procs);
+}
+
+// Cost of one scheduling decision: pick the next process and requeue it.
+static void bench_pick(long long n, int level){
+  static const char *variants[3]={"mlfq-L0","mlfq-L1","mlfq-L2"};
+  sim_reset();
+  queue_t *qs[3]={cpu_q(0,0,0),cpu_q(0,0,1),cpu_q(0,0,2)};
+  proc_t *procs=calloc(n,sizeof *procs);
+  for(long long i=0;i<n;i++){
+    procs[i].pid=(int)i+1; procs[i].level=level;
+    q_push(qs[level],&procs[i]);
+  }
+  long long ops=0, batch=n<100000 ? 100000 : n;
+  double ns=0;
+  while(ns < MIN_NS){
+    double t0=now_ns();
+    for(long long i=0;i<batch;i++){
+      int qid;
+      proc_t *p=pick_next(0,&qid);
+      q_push(qs[qid],p);
+    }
+    ns+=now_ns()-t0; ops+=batch;
+  }
+  result("pick_next",variants[level],n,"ns_per_op",ns/ops);
+  // The procs array is owned here; empty the queues before freeing it.
+  for(int i=0;i<3;i++) *qs[i]=(queue_t){0};
+  free(procs);
+}
+
+// Ticks per second of the full engine on a CPU-bound mix of jobs.
+static void bench_engine(bool with_trace){
+  int saved=-1;
+  if(with_trace){
+    fflush(stdout);
+    saved=dup(STDOUT_FILENO);
+    int devnull=open("/dev/null",O_WRONLY);
+    dup2(devnull,STDOUT_FILENO); close(devnull);
+  }
+  sim_reset();
+  trace=with_trace; tickless=true; max_ticks=2000000;
+  rng_state=42;
+  userinit_spin("gen 2000 20000 gap=50");
+  double t0=now_ns();
+  sim_run(-1);
+  double ns=now_ns()-t0;
+  long long ticks=stats.busy_ticks+stats.idle_ticks;
+  sim_reset();
+  trace=true;
+  if(with_trace){
+    fflush(stdout);
+    dup2(saved,STDOUT_FILENO); close(saved);
+  }
+  result("engine", with_trace ? "trace-on" : "trace-off", ticks, "ticks_per_sec", ticks/(ns/1e9));
+}
+
+int main(void){
+  static const long long sizes[]={10,1000,100000,1000000};
+  printf("{\n  \"version\": \"%s\",\n  \"tick_ms\": %d,\n  \"results\": [", BENCH_VERSION, TICK_MS);
+  bench_queue(1000000);
+  for(int s=0;s<4;s++){
+    bench_pick(sizes[s],0);
+    bench_pick(sizes[s],2);
+  }
+  bench_engine(false);
+  bench_engine(true);
+  struct rusage ru;
+  getrusage(RUSAGE_SELF,&ru);
+  printf("\n  ],\n  \"peak_rss_kb\": %ld\n}\n", ru.ru_maxrss);
+  return 0;
+}
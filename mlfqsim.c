@@ -12,13 +12,121 @@
  *   - If a process does not finish within a tick, it is re-enqueued at the
  *     tail of its current queue (round-robin).
  *   - A process exits the system when its CPU work budget reaches zero or less.
+ *   - A process may arrive later than time 0 ("spin 500 at=2000" arrives at
+ *     2000 ms); it enters L0 at the first tick boundary at or after that time.
+ *   - A process may carry a nice value (-20..19, "spin 500 nice=10") or a
+ *     static priority (100..139, "prio=130", same as nice+120). Nice scales
+ *     every quantum like the O(1) scheduler's timeslices (nice 0 keeps the
+ *     base quanta, nice -20 gets 8x, nice 19 1/20th, at least one tick) and
+ *     picks the starting level: nice<=0 starts in L0, 1..9 in L1, 10.. in L2.
+ *     --stats reports response/turnaround per tier (nice <0, 0 and >0).
+ *   - With several CPUs, "cpus=0-3,8" pins a process (or every job of a
+ *     gen) to those CPUs; placement and load balancing honour the mask.
+ *   - With --nodes, a dispatcher first sends each unpinned job to one of N
+ *     copies of the machine; it then only moves between that node's CPUs.
+ *   - "lock=A hold=20 every=100" makes a job hold mutex A for 20 ms of its
+ *     work, after every 100 ms of work outside (without every=, once at its
+ *     start). Waiters block off the run queues; the lock passes to the best
+ *     level waiting.
+ *   - "threads=8 barrier=50" makes a job 8 threads that each do its work and,
+ *     after every 50 ms of it, block until all of them got there: the job
+ *     moves at its slowest thread's pace.
+ *   - "fork=4x spin 200" makes a job fork 4 children of 200 ms each after it
+ *     first runs (or after fork-at=MS of its work); "wait" blocks it until
+ *     they exit, "child=inherit" starts them at its level rather than as new
+ *     jobs, and "depth=D" lets the children fork in turn.
+ *   - Processes may be placed in control groups ("spin 500 group=/batch").
+ *     "group /batch weight=512 quota=20 period=100" sets a group's CPU weight
+ *     and bandwidth limit; groups share the CPU by weight (CFS-style group
+ *     entities above each group's own L0/L1/L2) and a group that uses its
+ *     quota within a period is throttled until the period ends:
+ *       Group <path> THROTTLED
+ *       Group <path> UNTHROTTLED
  *
  * Output format (consumed by o1viz.py with --mode=mlfq):
  *   Process <name> <pid> has consumed 10 ms in L<level>
  *   Process <name> <pid> EXIT
+ * With --qtrace, every queue operation is also logged as it happens, so the
+ * exact queue contents at each tick can be rebuilt without re-running the
+ * policy:
+ *   Q+ <pid> L<level>      (enqueue at tail)
+ *   Q- <pid> L<level>      (dequeue from head)
+ *   Qv <pid> L<from> L<to> (demotion; the matching Q+ follows)
  *
  * Build: gcc -O2 -Wall -Wextra -std=c11 -o mlfqsim mlfqsim.c
+ *        (add -DMLFQ_PROF, or run "make prof", for hot-path profiling counters)
  * Run:   ./mlfqsim "spin 10000 &; spin 200000 &; spin 3000000 &;"
+ *        ./mlfqsim --tickless "spin 50 &; spin 50 at=60000 &;"
+ *
+ * Options (before the command string):
+ *   --tickless       Do not tick while idle: sleep straight to the next event,
+ *                    print one bulk IDLE line for the gap, and stop as soon as
+ *                    the last process exits (instead of after 10 idle ticks).
+ *   --max-ticks N    Safety cap on simulated ticks (default 100000).
+ *   --stats          Print busy/idle tick totals to stderr at exit.
+ *   --quiet          Do not print the per-tick trace.
+ *   --qtrace         Log queue operations (see output format above).
+ *   --stats-out FILE Write a compact summary stream for o1viz.py --dashboard:
+ *                    downsampled queue lengths and per-level CPU time, the
+ *                    response/turnaround histograms and a sample of jobs.
+ *   --workload FILE  Read the command list from FILE (one or more jobs per
+ *                    line). Lines are read lazily as the clock reaches their
+ *                    arrival times, so keep them sorted by at= for huge traces.
+ *   --progress N     Print a progress line to stderr every N simulated ticks:
+ *                    simulated time, ticks/s, runnable per level, completed
+ *                    jobs, running p99 response time and RSS.
+ *   --progress-sec S Same, every S seconds of wall-clock time.
+ *   --progress-out FILE  Send progress lines to FILE instead of stderr.
+ *   --shm NAME       Also publish fixed-size event records into a POSIX
+ *                    shared-memory ring (/dev/shm/NAME) for a live consumer
+ *                    such as o1viz.py --shm. The simulator waits when the
+ *                    ring is full, so a consumer must be attached.
+ *   --cpus N         Simulate N CPUs (one socket, no SMT) with per-CPU run
+ *                    queues and load balancing. Trace lines gain "on cpu N".
+ *   --topology FILE  Machine layout and costs from FILE (sockets, cores,
+ *                    threads, llc, penalty, remote, smt, capacity; see
+ *                    topo_load()), or "sys" for this machine's
+ *                    /sys/devices/system/cpu.
+ *   --nodes N        Cluster mode: N separate copies of the machine given by
+ *                    --cpus/--topology, fed by a dispatcher. Trace CPU
+ *                    numbers are cluster-wide (node n has CPUs n*K..).
+ *   --dispatch P     Dispatcher policy: random, po2 (default), least-loaded
+ *                    or jiq (join-idle-queue).
+ *   --dispatch-delay MS  Time a job spends on its way to its node.
+ *   --load-period MS How often nodes report their load to the dispatcher;
+ *                    in between it only adds the jobs it sent itself.
+ *   --core-sched     SMT siblings only run processes of the same control
+ *                    group together; a sibling with no match idles.
+ *   --capacity-aware On CPUs of different capacity (topology "capacity"
+ *                    lines or sysfs cpu_capacity), place L0 work on fast
+ *                    CPUs and L2 work on efficient ones, migrating misfits.
+ *   --governor G     Turn on the energy model (OPPs and C-states from the
+ *                    topology file, or built-in defaults) with frequency
+ *                    governor schedutil, performance or powersave; --stats
+ *                    then reports energy, throughput and p99 latency.
+ *   --quanta A,B,C   Override the L0/L1/L2 quanta (in ticks).
+ *   --pi             Priority inheritance for locks (lock=NAME): an owner
+ *                    with better-placed waiters runs at their level until it
+ *                    releases the lock.
+ *   --wakeup M       Wakeup preemption: tick (default; arrivals wait for the
+ *                    next tick boundary), immediate (a job arriving mid-tick
+ *                    takes an idle CPU at once and preempts a lower level of
+ *                    its group) or granularity (the same, but not before the
+ *                    running process has run --wakeup-gran MS, default 4).
+ *   --seed N         Seed for the pseudo-random workload generator.
+ *   --checkpoint-at T FILE
+ *                    Write a binary snapshot of the whole simulator state to
+ *                    FILE when the clock reaches tick T, then keep running.
+ *   --restore FILE   Resume from a snapshot instead of parsing a command list.
+ *                    The run-mode flags saved in it (quanta, --tickless,
+ *                    --pi, --wakeup, --core-sched, --capacity-aware,
+ *                    --governor) replace those given.
+ *   --branch-at T    "What-if" run: clone the state in memory at tick T, finish
+ *                    the baseline, then rewind to the clone and finish again
+ *                    with --branch-quanta A,B,C. Stats are printed for both.
+ *   --record FILE    Write the per-tick decision stream (pid + level) to FILE.
+ *   --replay FILE    Compare this run's decisions against a recorded stream
+ *                    and report the first divergence and totals on stderr.
  *
  * Mapping to xv6:
  *   - Think of L0/L1/L2 as separate run queues stored in proc.c
@@ -27,184 +135,3548 @@
  *   - The scheduler always prefers the highest non-empty queue first
  */
 
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L  // shm_open, ftruncate, mmap, nanosleep
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Hot-path profiling (build with -DMLFQ_PROF). Cycle counters bracket the
+// parsing, pick-next, accounting, allocation and trace-output sections, and
+// event counters track queue traffic. A breakdown is printed to stderr at
+// exit. Without the flag every macro expands to nothing.
+#ifdef MLFQ_PROF
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t prof_now(void){ return __rdtsc(); }
+#elif defined(__aarch64__)
+static inline uint64_t prof_now(void){ uint64_t v; __asm__ volatile("mrs %0, cntvct_el0" : "=r"(v)); return v; }
+#else
+static inline uint64_t prof_now(void){ return (uint64_t)clock(); }
+#endif
+enum { PROF_PARSE, PROF_PICK, PROF_ACCOUNT, PROF_ALLOC, PROF_TRACE, PROF_EVENTS, PROF_RUN, PROF_NSECT };
+enum { CNT_ARRIVAL, CNT_ENQUEUE, CNT_DEQUEUE, CNT_DEMOTE, CNT_EXIT, CNT_IDLE, CNT_NCNT };
+static uint64_t prof_cycles[PROF_NSECT], prof_calls[PROF_NSECT], prof_cnt[CNT_NCNT];
+#define PROF_BEGIN(s) uint64_t prof_t0_##s = prof_now()
+#define PROF_END(s) (prof_cycles[s] += prof_now()-prof_t0_##s, prof_calls[s]++)
+#define PROF_ADD(s) (prof_cycles[s] += prof_now()-prof_t0_##s)
+#define PROF_COUNT(c, n) (prof_cnt[c] += (n))
+#else
+#define PROF_BEGIN(s) ((void)0)
+#define PROF_END(s) ((void)0)
+#define PROF_ADD(s) ((void)0)
+#define PROF_COUNT(c, n) ((void)0)
+#endif
+
+// Marks helpers and switches that only main() uses, so builds with
+// MLFQSIM_NO_MAIN (mlfqbench.c, mlfqtest.c) compile without warnings.
+#define MAIN_ONLY __attribute__((unused))
 
 // A minimal process structure that mirrors just what we need for scheduling.
 // In xv6, this would be part of struct proc and include many more fields.
+// One exists per thread (see thread groups), so fields are ordered by size
+// and kept as narrow as their ranges allow: the struct packs without holes.
 typedef struct proc proc_t;
 struct proc {
+  proc_t *next;        // Intrusive next pointer for O(1) queues
+  long long work_left; // Remaining CPU work in microseconds
+  long long arrive_ms; // Arrival time in milliseconds (0 = present at boot)
+  long long first_run; // Time it first ran in ms (-1 = not yet)
+  long long woken_ms;  // Time it last became runnable in ms (-1 = ran since)
+  long long blocked_ms;// When it started waiting (lock, barrier or children)
+  long long lock_in;   // Work (us) until it next takes the lock (0 = now,
+                       // -1 = holding it or done with it)
+  long long crit_left; // Work (us) left in the critical section it holds
   int pid;             // Process ID (monotonic counter here)
-  char name[32];       // Short name (e.g., "spin")
-  int work_left;       // Remaining CPU work in milliseconds
   int ticks_left;      // Remaining ticks in the current quantum for this level
-  int level;           // Which MLFQ level the process is in (0/1/2)
-  proc_t *next;        // Intrusive next pointer for O(1) queues
+  int work_ms;         // Total CPU work requested, for slowdown metrics
+  int node;            // Cluster node (-1 = not dispatched yet)
+  int cpu;             // CPU whose run queues hold the process
+  int hold_ms;         // Critical section length, in CPU work
+  int every_ms;        // Work between critical sections (0 = only one)
+  int tg;              // Thread group (-1 = single-threaded)
+  int bar_left;        // Work (us) until its next barrier
+  int fork_in;         // Work (us) until it forks (-1 = never or done)
+  int fam;             // Family whose waiting parent it belongs to (-1 = none)
+  int16_t home;        // Socket it first ran on (-1 = not yet)
+  int8_t level;        // Which MLFQ level the process is in (0/1/2)
+  int8_t nice;         // Nice value (-20..19); scales quanta and start level
+  int8_t boost;        // Own level while priority inheritance boosts it
+  int8_t lock;         // Lock its critical sections take (-1 = none)
+  int8_t fk;           // Fork spec (-1 = never forks)
+  bool child;          // Created by a fork
+  uint8_t grp;         // Control group index (0 = root group "/")
+  uint8_t aff;         // CPU affinity set index (0 = every CPU)
+  char name[8];        // Short name (e.g., "spin"), cut to 7 characters
 };
 
 // A simple FIFO queue (O(1) push/pop) implemented with intrusive links above.
-typedef struct { proc_t *head, *tail; } queue_t;
+typedef struct { proc_t *head, *tail; int len; } queue_t;
 
 // Each tick is 10ms to keep numbers readable. The visualizer assumes this
 // when converting tick counts to milliseconds in the timeline.
 #define TICK_MS 10
 
 // Per-level time quantums (in ticks). You can play with these values during
-// lecture to show how latency and throughput change.
+// lecture to show how latency and throughput change, or override them at run
+// time with --quanta.
 #define Q_L0 1
 #define Q_L1 2
 #define Q_L2 4
+static int quantum[3]={Q_L0,Q_L1,Q_L2};
+
+
+// Nice handling, after the O(1) scheduler: static priority 120+nice gives a
+// base timeslice of (140-prio)*20ms below 120 and (140-prio)*5ms from 120 on,
+// i.e. 100ms at nice 0. The same ratio (relative to nice 0) scales each MLFQ
+// quantum, rounded to whole ticks and never below one.
+#define NICE_MIN (-20)
+#define NICE_MAX 19
+static int nice_slice(int nice, int base){
+  int prio=120+nice;
+  int scale = prio<120 ? (140-prio)*4 : 140-prio;   // nice 0 -> 20
+  int t=(base*scale+10)/20;
+  return t>0 ? t : 1;
+}
 
-static queue_t L0={0}, L1={0}, L2={0}; // Highest priority first
+// Batch tiers skip the interactive levels: nice 1..9 starts in L1 and
+// nice 10..19 in L2.
+static int nice_level(int nice){ return nice<=0 ? 0 : nice<10 ? 1 : 2; }
+
+// Reporting tiers: 0 = nice<0 (interactive), 1 = nice 0, 2 = nice>0 (batch).
+#define NTIERS 3
+static int nice_tier(int nice){ return nice<0 ? 0 : nice==0 ? 1 : 2; }
 static int next_pid=1;                 // Simple PID allocator
+static long long last_arrival;         // Arrival tick of the latest proc_start()
+static long long now=0;                // Current tick (simulated clock)
+static int idle_streak=0;              // Consecutive idle ticks (periodic mode)
+static uint64_t rng_state=0x9e3779b97f4a7c15ULL; // PRNG state (--seed)
+
+// Command-line switches.
+static bool tickless=false;            // --tickless: skip idle ticks in bulk
+static long long max_ticks=100000;     // --max-ticks: safety cap
+MAIN_ONLY static bool show_stats=false; // --stats: summary on stderr at exit
+static bool trace=true;                // per-tick trace on stdout (--quiet)
+static bool qtrace=false;              // --qtrace: log queue operations
+
+// Wakeup preemption (--wakeup). With "tick" an arrival waits for the next
+// tick boundary and then competes in the normal pick. The other modes let
+// it arrive mid-tick: it takes an idle CPU at once and preempts a process of
+// a lower level, right away ("immediate") or once that process has run for
+// wakeup_gran_ms ("granularity").
+enum { WAKE_TICK, WAKE_IMMEDIATE, WAKE_GRAN, NWAKES };
+static const char *const wake_name[NWAKES]={"tick","immediate","granularity"};
+static int wakeup_mode=WAKE_TICK;
+static int wakeup_gran_ms=4;           // --wakeup-gran
+
+// Tick at whose start an arrival at ms is handled: the boundary after it,
+// or with mid-tick wakeups the tick it falls into.
+static long long arrival_tick(long long ms){
+  return wakeup_mode==WAKE_TICK ? (ms+TICK_MS-1)/TICK_MS : ms/TICK_MS;
+}
+
+// Log-linear latency histogram: values below HIST_SUB get a bucket each,
+// above that every power of two is split into HIST_SUB buckets (about 6%
+// relative error), so any quantile is available in constant memory.
+#define HIST_SUB 16
+#define HIST_BUCKETS (61*HIST_SUB)
+typedef struct { uint64_t n[HIST_BUCKETS]; uint64_t count; } hist_t;
+
+static int hist_bucket(uint64_t v){
+  if(v<HIST_SUB) return (int)v;
+  int msb=63-__builtin_clzll(v);
+  return (msb-3)*HIST_SUB + (int)((v>>(msb-4))&(HIST_SUB-1));
+}
+
+// Smallest value that falls into bucket b.
+static uint64_t hist_lower(int b){
+  if(b<HIST_SUB) return (uint64_t)b;
+  int msb=b/HIST_SUB+3;
+  return (uint64_t)(HIST_SUB+b%HIST_SUB) << (msb-4);
+}
+
+static void hist_add(hist_t *h, uint64_t v){ h->n[hist_bucket(v)]++; h->count++; }
+
+// Value at quantile q (0..1), reported as the lower edge of its bucket.
+// Nearest rank: the ceil(q*count)-th smallest sample, so p99 of a small
+// sample is not truncated down past its tail.
+static uint64_t hist_quantile(const hist_t *h, double q){
+  if(!h->count) return 0;
+  double x=q*h->count;
+  uint64_t rank=(uint64_t)x, seen=0;
+  if(rank<x) rank++;
+  rank = rank ? rank-1 : 0;
+  if(rank>h->count-1) rank=h->count-1;
+  for(int b=0;b<HIST_BUCKETS;b++){
+    seen+=h->n[b];
+    if(seen>rank) return hist_lower(b);
+  }
+  return hist_lower(HIST_BUCKETS-1);
+}
+
+// Whole-run counters. Response is arrival to first run, turnaround is
+// arrival to exit, both in milliseconds.
+static struct {
+  long long busy_ticks, idle_ticks, exited;
+  long long level_ticks[3];            // CPU ticks spent at each level
+  hist_t resp, turn;
+  hist_t wake;                         // Wakeup to running, in ms
+  long long preempts, wake_held;       // Mid-tick preemptions; deferred by
+                                       // the granularity to the next tick
+  struct {                             // Same, split by nice tier
+    long long ticks, exited;
+    hist_t resp, turn;
+  } tier[NTIERS];
+  struct {                             // Same, split by the level a process
+    long long exited;                  // exits from (L0 = interactive,
+    hist_t resp, turn;                 // L2 = batch)
+  } cls[3];
+  struct {                             // Fork trees
+    long long forks, children;
+    hist_t resp, turn;                 // Of the children
+    hist_t wait;                       // Parents waiting for their children
+  } fork;
+  struct {                             // Thread groups
+    long long jobs, barriers;
+    long long wait_ms, life_ms;        // Thread time blocked at barriers; alive
+    hist_t turn;                       // Job arrival to last thread's exit
+    hist_t gap;                        // First to last thread at a barrier
+  } thr;
+} stats;
+
+// Dashboard stream (--stats-out). Queue lengths and CPU use are accumulated
+// into DASH_POINTS time windows; when the run outgrows them, neighbouring
+// windows are merged and the window doubles, so a billion-tick run still
+// produces a few thousand points. A reservoir keeps a uniform sample of
+// finished jobs for the slowdown scatter plot.
+#define DASH_POINTS 2048
+#define DASH_JOBS 2000
+typedef struct {
+  long long len_sum[3];                // Sum over ticks of queue lengths
+  long long busy[3], idle;             // Ticks run per level / idle ticks
+} dash_pt_t;
+typedef struct { int pid, work_ms; long long turn_ms, resp_ms; } dash_job_t;
+static FILE *dash_f;
+static struct {
+  long long width;                     // Ticks per window
+  dash_pt_t pt[DASH_POINTS];
+  dash_job_t job[DASH_JOBS];
+  long long jobs_seen;
+  uint64_t rng;                        // Own PRNG: sampling never perturbs the run
+} dash = { .width=1, .rng=0x2545f4914f6cdd1dULL };
+
+// Future events live in a binary min-heap ordered by tick. The sequence
+// number keeps events due on the same tick in the order they were scheduled,
+// so runs are deterministic. In tickless mode an idle CPU sleeps until the
+// head of this heap instead of ticking.
+enum { EV_ARRIVAL, EV_GEN, EV_WORKLOAD, EV_REFILL };
+typedef struct {
+  long long tick;
+  unsigned long long seq;
+  int kind;
+  int arg;             // Event-specific index (e.g. generator slot)
+  proc_t *p;           // Arriving process, if any
+} event_t;
+static event_t *evq; static int evq_len, evq_cap;
+static unsigned long long ev_seq;
+
+static bool ev_before(const event_t *a, const event_t *b){
+  return a->tick<b->tick || (a->tick==b->tick && a->seq<b->seq);
+}
+
+static void ev_push(long long tick, int kind, int arg, proc_t *p){
+  if(evq_len==evq_cap){
+    evq_cap = evq_cap ? evq_cap*2 : 64;
+    evq = realloc(evq, evq_cap*sizeof(*evq));
+    if(!evq){ perror("realloc"); exit(1); }
+  }
+  int i=evq_len++;
+  evq[i]=(event_t){ tick, ev_seq++, kind, arg, p };
+  while(i>0 && ev_before(&evq[i],&evq[(i-1)/2])){   // sift up
+    event_t t=evq[i]; evq[i]=evq[(i-1)/2]; evq[(i-1)/2]=t; i=(i-1)/2;
+  }
+}
+
+static event_t ev_pop(void){
+  event_t top=evq[0];
+  evq[0]=evq[--evq_len];
+  for(int i=0;;){                                     // sift down
+    int l=2*i+1, r=l+1, m=i;
+    if(l<evq_len && ev_before(&evq[l],&evq[m])) m=l;
+    if(r<evq_len && ev_before(&evq[r],&evq[m])) m=r;
+    if(m==i) break;
+    event_t t=evq[i]; evq[i]=evq[m]; evq[m]=t; i=m;
+  }
+  return top;
+}
+
+// xorshift64* PRNG. Its whole state is one word, so snapshots capture it
+// exactly and restored runs draw the same numbers.
+static uint64_t rng_next(void){
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+// Uniform integer in [lo, hi].
+static long long rng_range(long long lo, long long hi){
+  return lo + (long long)(rng_next() % (uint64_t)(hi-lo+1));
+}
+
+// Synthetic workload generators ("gen <count> <mean-ms> gap=<mean-ms>").
+// Each one lazily creates its next job when the previous one arrives, so a
+// long generated trace never sits in memory all at once.
+#define MAX_GEN 8
+// What a process spawns at its fork point (see "Fork trees").
+typedef struct {
+  int count, child_ms;                 // Children and their CPU work
+  int at_ms;                           // Parent's work before it forks
+  int next;                            // Spec the children fork by (-1 = none)
+  bool wait, inherit;                  // Parent waits; children take its level
+} forkspec_t;
+
+// Per-job options beyond the make_proc() arguments.
+typedef struct {
+  int lock, hold_ms, every_ms;         // Critical sections (see "Locks")
+  int threads, barrier_ms;             // Thread group (see "Thread groups")
+  forkspec_t fork; int depth;          // As parsed (see "Fork trees")
+  int fk;                              // Fork spec index (-1 = none)
+} jobspec_t;
+typedef struct {
+  long long left;      // Jobs still to create
+  int mean_ms;         // Mean CPU work per job (uniform in [1, 2*mean])
+  int mean_gap_ms;     // Mean inter-arrival gap (uniform in [0, 2*mean])
+  long long next_ms;   // Arrival time of the next job
+  int nice;            // Nice value given to every job
+  int grp;             // Control group of every job
+  int aff;             // Affinity set of every job
+  jobspec_t js;        // Locks and threads of every job
+} gen_t;
+static gen_t gens[MAX_GEN];
+static int ngens;
+
+// ---------------------------------------------------------------------------
+// Shared-memory event ring (--shm)
+//
+// A single-producer/single-consumer ring of fixed 24-byte records in a POSIX
+// shared-memory object. The producer owns head and the consumer owns tail;
+// both are free-running record counters on separate cache lines, and
+// head-tail is the fill level. Nothing is formatted or copied through a pipe:
+// a consumer maps the object and reads records in place (o1viz.py views them
+// as a numpy structured array). When the ring is full the simulator sleeps
+// until the consumer advances tail.
+//
+// Layout: 256-byte header, then capacity records.
+//   offset  0: magic "MLFQRING", u32 version, u32 record size, u64 capacity
+//   offset 64: u64 head, u32 done       offset 128: u64 tail
+// ---------------------------------------------------------------------------
+
+enum { RING_RUN=1, RING_IDLE, RING_EXIT, RING_ENQ, RING_DEQ, RING_DEMOTE };
+
+typedef struct {
+  uint64_t tick;       // Tick the event happened at
+  uint32_t pid;        // Process (0 for idle)
+  uint32_t arg;        // RUN: ms consumed; IDLE: idle ticks; DEMOTE: new level
+  uint8_t kind;        // RING_*
+  uint8_t level;       // Queue level involved
+  uint8_t pad[6];
+} ring_rec_t;
+
+typedef struct {
+  char magic[8];
+  uint32_t version, rec_size;
+  uint64_t capacity;
+  char pad0[64-24];
+  _Atomic uint64_t head;
+  _Atomic uint32_t done;
+  char pad1[64-12];
+  _Atomic uint64_t tail;
+  char pad2[128-8];
+} ring_hdr_t;
+_Static_assert(sizeof(ring_hdr_t)==256 && sizeof(ring_rec_t)==24, "ring layout is shared with o1viz.py");
+
+#define RING_CAPACITY (1u<<16)
+
+static ring_hdr_t *ring;
+static ring_rec_t *ring_recs;
+static uint64_t ring_head, ring_tail_seen;   // Producer-local copies
+static char ring_name[256];
+
+MAIN_ONLY static bool ring_open(const char *name){
+  snprintf(ring_name,sizeof ring_name,"/%s",name[0]=='/' ? name+1 : name);
+  size_t size=sizeof(ring_hdr_t)+(size_t)RING_CAPACITY*sizeof(ring_rec_t);
+  int fd=shm_open(ring_name,O_CREAT|O_TRUNC|O_RDWR,0600);
+  if(fd<0) return false;
+  if(ftruncate(fd,(off_t)size)<0){ close(fd); return false; }
+  void *m=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if(m==MAP_FAILED) return false;
+  ring=m; ring_recs=(ring_rec_t*)(ring+1);
+  memcpy(ring->magic,"MLFQRING",8);
+  ring->version=1; ring->rec_size=sizeof(ring_rec_t); ring->capacity=RING_CAPACITY;
+  atomic_store(&ring->tail,0);
+  atomic_store(&ring->head,0);
+  atomic_store(&ring->done,0);
+  return true;
+}
+
+static void ring_put(int kind, uint32_t pid, int level, uint32_t arg){
+  if(ring_head-ring_tail_seen==RING_CAPACITY){
+    // Full: wait for the consumer (backpressure).
+    struct timespec ts={0,50000};
+    while((ring_tail_seen=atomic_load_explicit(&ring->tail,memory_order_acquire))
+          ==ring_head-RING_CAPACITY)
+      nanosleep(&ts,NULL);
+  }
+  ring_rec_t *r=&ring_recs[ring_head&(RING_CAPACITY-1)];
+  *r=(ring_rec_t){ (uint64_t)now, pid, arg, (uint8_t)kind, (uint8_t)level, {0} };
+  ring_head++;
+  // Publish in batches; ring_close() publishes the remainder.
+  if(!(ring_head&63)) atomic_store_explicit(&ring->head,ring_head,memory_order_release);
+}
+
+MAIN_ONLY static void ring_close(void){
+  atomic_store_explicit(&ring->head,ring_head,memory_order_release);
+  atomic_store_explicit(&ring->done,1,memory_order_release);
+  munmap(ring,sizeof(ring_hdr_t)+(size_t)RING_CAPACITY*sizeof(ring_rec_t));
+  ring=NULL;
+}
+
+// ---------------------------------------------------------------------------
+// CPUs, topology and control groups
+//
+// Every CPU has its own copy of the run queues: for each control group a
+// small run-queue structure (grq_t) with the group's three MLFQ levels, the
+// root group's levels being the classic L0/L1/L2. Processes belong to one CPU
+// at a time (p->cpu) and only that CPU picks them; load balancing moves them.
+//
+// Groups form a tree under the root group "/". Picking walks down from the
+// CPU's root: at each group the candidates are the group's own processes
+// (one entity of weight GROUP_WEIGHT) and the child groups on its runnable
+// list, and the smallest weighted virtual runtime wins, as with CFS group
+// entities. Inside the chosen group the usual MLFQ rule applies.
+//
+// A group with a quota may run quota_ms (itself plus descendants, on all
+// CPUs together) in every period_ms. Using it up throttles the group: on
+// every CPU it is unlinked from its parent's runnable list and its runnable
+// count is taken out of its ancestors, which hides the whole subtree from
+// the pick until an EV_REFILL timer at the end of the period links it back.
+// ---------------------------------------------------------------------------
+
+#define MAX_GROUPS 64
+#define GROUP_WEIGHT 1024              // Default weight (cgroup v1 cpu.shares)
+#define GROUP_PERIOD_MS 100            // Default cfs_period
+typedef struct {
+  char path[64];
+  int parent;                          // Parent group index (-1 for the root)
+  int weight;
+  int quota_ms, period_ms;             // quota_ms 0 = unlimited
+  long long used_ms;                   // Runtime used in the current period
+  long long period;                    // Index of the current period
+  bool throttled;
+  long long ticks, exited;             // Reporting, plus cgroup cpu.stat's
+  long long periods, throttles;        // nr_periods, nr_throttled and
+  long long throttled_ticks;           // throttled_time
+  long long throttled_since;
+  hist_t resp, turn;
+} group_t;
+#define GROUP_INIT(p, par) { .path=p, .parent=par, .weight=GROUP_WEIGHT, \
+                             .period_ms=GROUP_PERIOD_MS, .period=-1 }
+static group_t groups[MAX_GROUPS]={ GROUP_INIT("/",-1) };
+static int ngroups=1;
+
+// One group's share of one CPU.
+typedef struct {
+  int nr;                              // Runnable processes in the subtree,
+                                       // not counting throttled child groups
+  int rq_head, rq_tail;                // Runnable, unthrottled child groups
+  int rq_prev, rq_next;                // Links in the parent's list (-1 = none)
+  long long vruntime;                  // Weighted run time as a child entity,
+                                       // in ms<<10 at GROUP_WEIGHT
+  long long self_vruntime;             // Same for the group's own processes
+  long long min_vruntime;              // Floor for children that wake up
+  queue_t q[3];                        // The group's MLFQ levels
+} grq_t;
+#define GRQ_INIT { .rq_head=-1, .rq_tail=-1, .rq_prev=-1, .rq_next=-1 }
+
+// Scheduling-domain levels, innermost first: SMT siblings share a core, LLC
+// spans the cores behind one last-level cache, PKG one socket and NUMA the
+// whole machine.
+enum { DOM_SMT, DOM_LLC, DOM_PKG, DOM_NUMA, NDOMS };
+static const char *const dom_name[NDOMS]={"smt","llc","pkg","numa"};
+
+#define MAX_CPUSETS 64
+
+typedef struct {
+  int core, llc, socket;               // Topology ids (dense, machine-wide)
+  int node;                            // Cluster node (--nodes)
+  int lo[NDOMS], hi[NDOMS];            // CPU id range of each domain
+  int capacity;                        // Work per tick, percent of a full tick
+  int opp;                             // Current frequency (energy model)
+  int util;                            // PELT-style utilization, 0..UTIL_SCALE
+  long long idle_from;                 // First tick of the current idle period
+  proc_t *curr;                        // Picked for the current tick
+  int curr_q;                          // Level it was picked from
+  proc_t *wakee;                       // Arrives mid-tick and takes over
+  int wake_ms;                         // ... at this offset into the tick
+  int run_pid;                         // Last process run, since run_from ms
+  long long run_last, run_from;        // (last tick it ran, --wakeup-gran)
+  int nr_level[3];                     // Queued per level, all groups
+  uint64_t allowed_sets;               // Affinity sets that include this CPU
+  uint64_t queued_sets;                // Sets with processes queued here
+  int nr_set[MAX_CPUSETS];             // Queued per set
+  long long busy_ticks;
+  grq_t g[MAX_GROUPS];                 // Per-group run queues; g[0] is the root
+} cpu_t;
+
+#define MAX_CPUS 16384
+static cpu_t cpu0={ .capacity=100, .allowed_sets=1, .g={ [0 ... MAX_GROUPS-1]=GRQ_INIT } };
+static cpu_t *cpus=&cpu0;
+static int ncpus=1;
+
+// CPU affinity ("spin 500 cpus=0-3,8"). Distinct masks are interned as
+// sets, like groups; set 0 allows every CPU. Each CPU keeps a bitmap of the
+// sets that allow it and one of the sets that have processes queued on it,
+// so "may anything on src run on dst?" is a single AND, and placement walks
+// the set bits of a mask instead of every CPU.
+#define MASK_WORDS (MAX_CPUS/64)
+typedef struct {
+  uint64_t w[MASK_WORDS];
+  char spec[32];                       // As written, for reports
+  long long exited;
+  hist_t resp, turn;
+} cpuset_t;
+static cpuset_t cpusets[MAX_CPUSETS]={ { .spec="all" } };
+static int ncpusets=1;
+
+static bool cpu_allowed(int cpu, const proc_t *p){ return cpus[cpu].allowed_sets>>p->aff&1; }
+
+// Cluster mode (--nodes N): the machine above is repeated N times as
+// separate hosts. Nothing migrates between nodes; a dispatcher assigns each
+// arriving job to a node (see dispatch()). Every node keeps its own ready
+// and overloaded counts, and two bitmaps (nodes with queued work, CPUs with
+// queued work) let a tick visit only busy CPUs, so idle nodes cost nothing
+// and all nodes share the one event heap. Without --nodes there is a single
+// node holding every CPU.
+#define MAX_NODES MAX_CPUS
+typedef struct {
+  int lo, hi;                          // CPU id range
+  int nr, busy, overloaded;            // Ready processes, CPUs with any, with 2+
+  int jobs;                            // Dispatched here and not yet exited
+  int seen;                            // Dispatcher's (stale) view of jobs
+  int heap_pos;                        // Slot in the least-loaded heap
+  bool in_jiq;                         // Listed as idle for join-idle-queue
+  long long dispatched;                // Reporting
+} node_t;
+static node_t nodes[MAX_NODES]={ { .hi=1 } };
+static int nnodes=1;
+static uint64_t node_busy[MAX_NODES/64];   // Nodes with ready processes
+static uint64_t cpu_busy[MAX_CPUS/64];     // CPUs with ready processes
+static uint64_t group_on[MAX_GROUPS][MAX_CPUS/64];  // CPUs with g[].nr>0
+
+enum { DISP_RANDOM, DISP_PO2, DISP_LEAST, DISP_JIQ, NDISPS };
+static const char *const disp_name[NDISPS]={"random","po2","least-loaded","jiq"};
+static struct {
+  int policy;                          // --dispatch
+  long long delay;                     // --dispatch-delay, in ticks
+  long long period;                    // --load-period: ticks between reports
+  long long next_report;
+  uint64_t rng;                        // Own PRNG: policies never perturb gen
+  int jiq_head, jiq_len;               // Idle nodes, FIFO ring over jiq[]
+  long long jiq_misses;                // JIQ dispatches with no idle node
+} cl={ .policy=DISP_PO2, .period=1, .rng=0x853c49e6748fea9bULL };
+static int jiq[MAX_NODES];
+static int ll_heap[MAX_NODES];         // Nodes ordered by (seen, id)
+
+// Next set bit after c in bitmap w of n bits, or -1.
+static int bits_next(const uint64_t *w, int n, int c){
+  c++;
+  for(int i=c/64; i*64<n; i++){
+    uint64_t m = i==c/64 ? w[i]&(~0ULL<<(c%64)) : w[i];
+    if(m) return i*64+__builtin_ctzll(m);
+  }
+  return -1;
+}
+
+// Next CPU after c in set s, or -1; cpuset_next(s,-1) is the first one.
+static int cpuset_next(int s, int c){
+  if(!s) return c+1<ncpus ? c+1 : -1;
+  return bits_next(cpusets[s].w,ncpus,c);
+}
+
+// Intern mask w (CPUs beyond ncpus already cleared). A full mask gives set
+// 0; so does an empty one (no CPU of this machine) or a full table, with a
+// warning.
+static int cpuset_get(const uint64_t *w, const char *spec, int len){
+  int n=0;
+  for(int i=0;i<MASK_WORDS;i++) n+=__builtin_popcountll(w[i]);
+  if(n==ncpus) return 0;
+  if(!n){
+    fprintf(stderr,"mlfqsim: cpus=%.*s names no CPU of this machine (%d CPUs); using all\n",len,spec,ncpus);
+    return 0;
+  }
+  for(int s=1;s<ncpusets;s++)
+    if(!memcmp(cpusets[s].w,w,sizeof cpusets[s].w)) return s;
+  if(ncpusets==MAX_CPUSETS){
+    fprintf(stderr,"mlfqsim: cpus=%.*s: more than %d distinct CPU sets; using all\n",len,spec,MAX_CPUSETS-1);
+    return 0;
+  }
+  int s=ncpusets++;
+  cpuset_t *cs=&cpusets[s];
+  memset(cs,0,sizeof *cs);
+  memcpy(cs->w,w,sizeof cs->w);
+  snprintf(cs->spec,sizeof cs->spec,"%.*s",len,spec);
+  for(int c=cpuset_next(s,-1);c>=0;c=cpuset_next(s,c)) cpus[c].allowed_sets|=1ULL<<s;
+  return s;
+}
+
+// Topology parameters (--topology). A migration costs the extra CPU work of
+// the innermost domain both CPUs share, and running away from the process's
+// home socket (where it first ran) slows it down by remote_pct percent.
+// Two busy SMT siblings each run at smt_pct percent of a full core. CPUs
+// with the highest capacity are "fast", the rest "efficient".
+static struct {
+  int sockets, cores, threads;         // Cores per socket, threads per core
+  long long penalty_us[NDOMS];
+  int remote_pct;                      // 100 = no NUMA effect
+  int smt_pct;                         // Speed with a busy sibling (100 = none)
+  int cap_max;                         // Highest CPU capacity
+  bool asym;                           // CPU capacities differ
+  long long migrations[NDOMS];         // Reporting
+  long long remote_ticks, contended_ticks, forced_idle, misfits;
+} topo={ .sockets=1, .cores=1, .threads=1, .remote_pct=100, .smt_pct=100, .cap_max=100 };
+static bool core_sched=false;          // --core-sched: pair same-group only
+static bool capacity_aware=false;      // --capacity-aware: place by class
+
+// Energy model (topology "opp", "cdyn" and "cstate" lines, --governor): an
+// OPP table shared by all CPUs, each CPU at one OPP at a time, and a ladder
+// of idle states from shallowest to deepest. Off while nopp is 0.
+#define MAX_OPPS 16
+#define MAX_CSTATES 8
+typedef struct {
+  char name[8];
+  double mw;                           // Power while in the state
+  int residency_ms;                    // Idle time before it is entered
+  int exit_us;                         // Wakeup latency, paid as extra work
+} cstate_t;
+static struct {
+  int nopp, ncstates;
+  int mhz[MAX_OPPS];                   // Ascending
+  double volt[MAX_OPPS];
+  double cdyn_nf;                      // Switched capacitance in nF
+  cstate_t cs[MAX_CSTATES];
+  double busy_j, idle_j;               // Reporting
+  long long mhz_ticks;                 // Sum of MHz over busy ticks
+  long long cs_ticks[MAX_CSTATES], wakeups[MAX_CSTATES];
+} pm={ .cdyn_nf=1.0 };
+enum { GOV_SCHEDUTIL, GOV_PERFORMANCE, GOV_POWERSAVE, NGOVS };
+static const char *const gov_name[NGOVS]={"schedutil","performance","powersave"};
+static int governor=GOV_SCHEDUTIL;     // --governor
+
+static int runnable[3];                // Queued processes per level, all CPUs
+static long long nr_ready;             // Queued and not throttled, all CPUs
+static int nr_overloaded;              // CPUs with two or more ready
+
+static queue_t* cpu_q(int cpu, int g, int level){ return &cpus[cpu].g[g].q[level]; }
+static queue_t* proc_q(const proc_t *p){ return cpu_q(p->cpu, p->grp, p->level); }
+
+static int group_own_len(int cpu, int g){
+  const grq_t *r=&cpus[cpu].g[g];
+  return r->q[0].len + r->q[1].len + r->q[2].len;
+}
+
+static int level_len(int level){ return runnable[level]; }
+
+// Innermost domain that contains both CPUs.
+static int cpu_domain(int a, int b){
+  if(cpus[a].core==cpus[b].core) return DOM_SMT;
+  if(cpus[a].llc==cpus[b].llc) return DOM_LLC;
+  if(cpus[a].socket==cpus[b].socket) return DOM_PKG;
+  return DOM_NUMA;
+}
+
+// Find the group for path[0..len), creating it and any missing ancestors
+// with default settings. Returns 0 (the root) for "/" or when full.
+static int group_get(const char *path, int len){
+  while(len>1 && path[len-1]=='/') len--;
+  if(len<=1 || path[0]!='/') return 0;
+  for(int g=1;g<ngroups;g++)
+    if((int)strlen(groups[g].path)==len && !strncmp(groups[g].path,path,len)) return g;
+  int cut=len-1;
+  while(cut>0 && path[cut]!='/') cut--;
+  int parent=group_get(path,cut);
+  if(ngroups==MAX_GROUPS || len>=(int)sizeof groups[0].path){
+    fprintf(stderr,"mlfqsim: group %.*s: more than %d groups or path over %d characters; using /\n",
+            len,path,MAX_GROUPS-1,(int)sizeof groups[0].path-1);
+    return 0;
+  }
+  int g=ngroups++;
+  group_t *gr=&groups[g];
+  *gr=(group_t)GROUP_INIT("",parent);
+  snprintf(gr->path,sizeof gr->path,"%.*s",len,path);
+  return g;
+}
+
+// Put group g on its parent's runnable list on one CPU (at the tail, so
+// vruntime ties go to the group that has been waiting longest) or take it
+// off, in O(1). A group that comes back starts no lower than its parent's
+// min_vruntime, so time spent asleep or throttled does not bank CPU time.
+static void group_link(int cpu, int g){
+  grq_t *r=&cpus[cpu].g[g], *pr=&cpus[cpu].g[groups[g].parent];
+  if(r->vruntime<pr->min_vruntime) r->vruntime=pr->min_vruntime;
+  r->rq_prev=pr->rq_tail; r->rq_next=-1;
+  if(pr->rq_tail>=0) cpus[cpu].g[pr->rq_tail].rq_next=g; else pr->rq_head=g;
+  pr->rq_tail=g;
+}
+
+static void group_unlink(int cpu, int g){
+  grq_t *r=&cpus[cpu].g[g], *pr=&cpus[cpu].g[groups[g].parent];
+  if(r->rq_prev>=0) cpus[cpu].g[r->rq_prev].rq_next=r->rq_next; else pr->rq_head=r->rq_next;
+  if(r->rq_next>=0) cpus[cpu].g[r->rq_next].rq_prev=r->rq_prev; else pr->rq_tail=r->rq_prev;
+  r->rq_prev=r->rq_next=-1;
+}
+
+// Add d runnable processes to group g and its ancestors on one CPU, stopping
+// at a throttled group (its subtree is hidden from everything above it).
+// Groups whose count crosses zero join or leave their parent's runnable list.
+static void group_nr_add(int cpu, int g, int d){
+  for(; g>=0; g=groups[g].parent){
+    grq_t *r=&cpus[cpu].g[g];
+    int was=r->nr;
+    r->nr+=d;
+    if(!was!=!r->nr) group_on[g][cpu/64]^=1ULL<<(cpu%64);
+    if(groups[g].throttled) return;
+    if(groups[g].parent<0) break;
+    if(!was && r->nr) group_link(cpu,g);
+    else if(was && !r->nr) group_unlink(cpu,g);
+  }
+  // Reached the root: the change is visible machine-wide.
+  int nr=cpus[cpu].g[0].nr, was=nr-d, ovl=(nr>=2)-(was>=2);
+  node_t *n=&nodes[cpus[cpu].node];
+  nr_ready+=d; n->nr+=d;
+  nr_overloaded+=ovl; n->overloaded+=ovl;
+  if(!was!=!nr){
+    cpu_busy[cpu/64]^=1ULL<<(cpu%64);
+    int id=cpus[cpu].node;
+    if(nr ? !n->busy++ : !--n->busy) node_busy[id/64]^=1ULL<<(id%64);
+  }
+}
+
+// Choose the group whose own queues supply the next process on cpu. Only
+// runnable children are on the lists, so each step costs O(runnable
+// children).
+static int group_pick(int cpu){
+  int g=0;
+  for(;;){
+    grq_t *r=&cpus[cpu].g[g];
+    int best = group_own_len(cpu,g) ? g : -1;
+    long long bv = r->self_vruntime;
+    for(int c=r->rq_head;c>=0;c=cpus[cpu].g[c].rq_next)
+      if(best<0 || cpus[cpu].g[c].vruntime<bv){ best=c; bv=cpus[cpu].g[c].vruntime; }
+    if(best<0 || best==g) return g;
+    if(bv>r->min_vruntime) r->min_vruntime=bv;
+    g=best;
+  }
+}
+
+static long long group_period_ticks(const group_t *gr){
+  return gr->period_ms/TICK_MS>0 ? gr->period_ms/TICK_MS : 1;
+}
+
+// Out of quota: take the subtree off the run queues of every CPU where it
+// has runnable processes (group_on), in O(1) per such CPU plus the count
+// update up the tree, and arm the refill timer for the period's end.
+static void group_throttle(int g){
+  group_t *gr=&groups[g];
+  gr->throttled=true; gr->throttles++;
+  gr->throttled_since=now+1;           // The current tick still runs
+  if(trace) printf("Group %s THROTTLED\n", gr->path);
+  for(int c=bits_next(group_on[g],ncpus,-1);c>=0;c=bits_next(group_on[g],ncpus,c)){
+    int nr=cpus[c].g[g].nr;
+    group_unlink(c,g);
+    group_nr_add(c, gr->parent, -nr);
+  }
+  ev_push((gr->period+1)*group_period_ticks(gr), EV_REFILL, g, NULL);
+}
+
+// EV_REFILL: the period is over, so the group may run again. Its usage is
+// reset by group_charge() when it first runs in the new period.
+static void group_refill(int g){
+  group_t *gr=&groups[g];
+  gr->throttled=false;
+  gr->throttled_ticks+=now-gr->throttled_since;
+  if(trace) printf("Group %s UNTHROTTLED\n", gr->path);
+  for(int c=bits_next(group_on[g],ncpus,-1);c>=0;c=bits_next(group_on[g],ncpus,c)){
+    int nr=cpus[c].g[g].nr;
+    group_link(c,g);
+    group_nr_add(c, gr->parent, nr);
+  }
+}
+
+// Charge one tick of CPU to group g and its ancestors.
+static void group_charge(int cpu, int g){
+  cpus[cpu].g[g].self_vruntime+=(long long)TICK_MS<<10;
+  for(; g>=0; g=groups[g].parent){
+    group_t *gr=&groups[g];
+    gr->ticks++;
+    cpus[cpu].g[g].vruntime+=((long long)TICK_MS*GROUP_WEIGHT<<10)/gr->weight;
+    if(!gr->quota_ms || gr->parent<0) continue;   // The root is never limited
+    long long period=now/group_period_ticks(gr);
+    if(period!=gr->period){ gr->period=period; gr->used_ms=0; gr->periods++; }
+    gr->used_ms+=TICK_MS;
+    if(gr->used_ms>=gr->quota_ms && !gr->throttled) group_throttle(g);
+  }
+}
 
 // Enqueue a process at the tail in O(1) time.
 static void q_push(queue_t *q, proc_t *p){
+  PROF_COUNT(CNT_ENQUEUE, 1);
+  if(qtrace){
+    if(trace) printf("Q+ %d L%d\n", p->pid, p->level);
+    if(ring) ring_put(RING_ENQ, (uint32_t)p->pid, p->level, 0);
+  }
+  runnable[p->level]++;
+  cpu_t *c=&cpus[p->cpu];
+  c->nr_level[p->level]++;
+  c->nr_set[p->aff]++; c->queued_sets|=1ULL<<p->aff;
+  group_nr_add(p->cpu, p->grp, 1);
   p->next=NULL;
+  q->len++;
   if(!q->head){ q->head=q->tail=p; }
   else { q->tail->next=p; q->tail=p; }
 }
 
+// Counters for p leaving q (shared by q_pop() and q_take()).
+static void q_leave(queue_t *q, proc_t *p){
+  PROF_COUNT(CNT_DEQUEUE, 1);
+  if(qtrace){
+    if(trace) printf("Q- %d L%d\n", p->pid, p->level);
+    if(ring) ring_put(RING_DEQ, (uint32_t)p->pid, p->level, 0);
+  }
+  runnable[p->level]--;
+  cpu_t *c=&cpus[p->cpu];
+  c->nr_level[p->level]--;
+  if(!--c->nr_set[p->aff]) c->queued_sets&=~(1ULL<<p->aff);
+  group_nr_add(p->cpu, p->grp, -1);
+  q->len--;
+}
+
 // Pop the head in O(1) time.
 static proc_t* q_pop(queue_t *q){
   proc_t* p=q->head;
   if(!p) return NULL;
+  q_leave(q,p);
   q->head=p->next;
   if(!q->head) q->tail=NULL;
   p->next=NULL;
   return p;
 }
 
-// Helper to check the command name; illustrative here (not strictly needed).
-static bool is_spin(const char *s){return strncmp(s,"spin",4)==0;}
+// Unlink the first process in q whose affinity set is in the bitmap ok.
+// Only used for migration, and only once the queue's CPU is known to hold
+// such a process, so the walk stops at the first hit.
+static proc_t* q_take(queue_t *q, uint64_t ok){
+  for(proc_t *prev=NULL, *p=q->head; p; prev=p, p=p->next){
+    if(!(ok>>p->aff&1)) continue;
+    if(!prev) return q_pop(q);
+    q_leave(q,p);
+    prev->next=p->next;
+    if(q->tail==p) q->tail=prev;
+    p->next=NULL;
+    return p;
+  }
+  return NULL;
+}
 
-// Create a new process starting at L0 with L0's quantum.
-static proc_t* new_proc(const char*name,int ms){
-  proc_t *p=calloc(1,sizeof(*p));
-  p->pid=next_pid++;
-  snprintf(p->name,sizeof(p->name),"%s",name);
-  p->work_left=ms;
-  p->level=0;             // start at top level
-  p->ticks_left=Q_L0;     // initialize its quantum
-  q_push(&L0,p);
-  return p;
+// Unlink p from anywhere in q (priority inheritance moving a lock owner).
+static void q_remove(queue_t *q, proc_t *p){
+  proc_t *prev=NULL;
+  for(proc_t *x=q->head; x!=p; x=x->next) prev=x;
+  if(!prev){ q_pop(q); return; }
+  q_leave(q,p);
+  prev->next=p->next;
+  if(q->tail==p) q->tail=prev;
+  p->next=NULL;
 }
 
-// Parse a tiny subset of shell-like input to create spin processes.
-// Example accepted input: "spin 10000 &; spin 200000 &; spin 3000000 &;"
-// We ignore separators like '&' and ';' and only look for: spin <integer>
-static void userinit_spin(const char *cmd){
-  const char *s=cmd;
-  while(*s){
-    // Skip whitespace and separators
-    while(*s==' '||*s=='\t'||*s==';'||*s=='&') s++;
-    if(!*s) break;
+// ---------------------------------------------------------------------------
+// Placement and load balancing (more than one CPU)
+//
+// CPUs are numbered in topology order, so every domain a CPU belongs to is a
+// contiguous range [lo, hi) of CPU ids and scanning it costs its size. Each
+// CPU balances each of its domains every span-size ticks (staggered by CPU
+// id), pulling from the busiest CPU in the span until the two differ by at
+// most one; a CPU that runs dry pulls right away from its nearest
+// non-NUMA domains. Nothing is scanned while no CPU has a second process.
+//
+// On machines whose CPUs differ in capacity, --capacity-aware sorts work by
+// class: L0 (interactive) processes belong on fast CPUs and L2 (batch) ones
+// on efficient CPUs, L1 anywhere. A process that is on the wrong kind of
+// CPU is a misfit: it is moved when it gets demoted to L2, and a fast CPU
+// that runs dry pulls from the efficient CPUs of its package, interactive
+// work first.
+// ---------------------------------------------------------------------------
 
-    // Recognize the command name
-    if(strncmp(s,"spin",4)==0){
-      s += 4;
-      while(*s==' '||*s=='\t') s++;
-      // Parse decimal integer for work in ms
-      int ms = 0;
-      while(*s>='0'&&*s<='9') { ms = ms*10 + (*s-'0'); s++; }
-      if(ms>0) new_proc("spin", ms);
+static bool cpu_fast(int cpu){ return cpus[cpu].capacity>=topo.cap_max; }
+
+// 1 if cpu is the wrong class of CPU for p under --capacity-aware.
+static int cpu_misfit(int cpu, const proc_t *p){
+  if(!capacity_aware || !topo.asym || p->level==1) return 0;
+  return cpu_fast(cpu) != (p->level==0);
+}
+
+// Processes on cpu that MLFQ would run before or alongside p: the ones
+// queued at p's level or above. An L0 arrival does not wait behind batch
+// work, so for it a CPU busy with L2 is as good as an idle one.
+static int cpu_ahead(int cpu, const proc_t *p){
+  const int *n=cpus[cpu].nr_level;
+  return p->level==0 ? n[0] : p->level==1 ? n[0]+n[1] : n[0]+n[1]+n[2];
+}
+
+// Ready processes on cpu's whole core (all its SMT threads).
+static int core_load(int cpu){
+  int n=0;
+  for(int x=cpus[cpu].lo[DOM_SMT];x<cpus[cpu].hi[DOM_SMT];x++) n+=cpus[x].g[0].nr;
+  return n;
+}
+
+// Wakeup placement: the CPU with the fewest ready processes; ties go to the
+// CPU on the least-loaded core (a fully idle core beats an idle SMT thread
+// next to a busy one) and then to the CPU closest to the one the process
+// last used. With --capacity-aware, load counts only the processes that
+// would compete with p (cpu_ahead()) and a CPU of the right class wins ties.
+// Only CPUs in p's affinity set, or else on p's node, are considered.
+static int select_cpu(const proc_t *p){
+  bool aware=capacity_aware && topo.asym;
+  int lo=0, hi=ncpus;
+  if(!p->aff && p->node>=0){ lo=nodes[p->node].lo; hi=nodes[p->node].hi; }
+  int prev=p->cpu;
+  if(!cpu_allowed(prev,p) || prev<lo || prev>=hi) prev=cpuset_next(p->aff,lo-1);
+  int best=prev, bc=core_load(prev), bm=cpu_misfit(prev,p);
+  int bn=aware ? cpu_ahead(prev,p) : cpus[prev].g[0].nr;
+  for(int c=cpuset_next(p->aff,lo-1); c>=0 && c<hi && (bc || bm); c=cpuset_next(p->aff,c)){
+    int n=aware ? cpu_ahead(c,p) : cpus[c].g[0].nr;
+    if(n>bn) continue;
+    int m=cpu_misfit(c,p);
+    if(n==bn && m>bm) continue;
+    int cl=core_load(c);
+    if(n<bn || m<bm || cl<bc || (cl==bc && cpu_domain(prev,c)<cpu_domain(prev,best))){ best=c; bn=n; bm=m; bc=cl; }
+  }
+  return best;
+}
+
+// ---------------------------------------------------------------------------
+// Cluster dispatcher (--nodes, --dispatch)
+//
+// The dispatcher does not see the nodes' live state. It works from load
+// reports (jobs per node) refreshed every cl.period ticks, plus the jobs it
+// has sent since the last report, and a dispatched job reaches its node
+// cl.delay ticks later (through the event heap). Policies:
+//   random        uniform node
+//   po2           the less loaded of two random nodes
+//   least-loaded  minimum of a heap keyed by (load, node id)
+//   jiq           join-idle-queue: nodes that run out of jobs put themselves
+//                 on an idle list; take the oldest entry, or a random node
+//                 if the list is empty
+// ---------------------------------------------------------------------------
+
+static int rand_node(void){
+  cl.rng^=cl.rng<<13; cl.rng^=cl.rng>>7; cl.rng^=cl.rng<<17;
+  return (int)(cl.rng%(uint64_t)nnodes);
+}
+
+static bool ll_less(int a, int b){
+  return nodes[a].seen<nodes[b].seen || (nodes[a].seen==nodes[b].seen && a<b);
+}
+
+static void ll_swap(int i, int j){
+  int t=ll_heap[i]; ll_heap[i]=ll_heap[j]; ll_heap[j]=t;
+  nodes[ll_heap[i]].heap_pos=i; nodes[ll_heap[j]].heap_pos=j;
+}
+
+static void ll_down(int i){
+  for(;;){
+    int l=2*i+1, r=l+1, m=i;
+    if(l<nnodes && ll_less(ll_heap[l],ll_heap[m])) m=l;
+    if(r<nnodes && ll_less(ll_heap[r],ll_heap[m])) m=r;
+    if(m==i) return;
+    ll_swap(i,m); i=m;
+  }
+}
+
+// New load reports: every node's current job count, O(nodes) per period.
+static void load_report(void){
+  for(int n=0;n<nnodes;n++) nodes[n].seen=nodes[n].jobs;
+  if(cl.policy==DISP_LEAST){
+    for(int n=0;n<nnodes;n++){ ll_heap[n]=n; nodes[n].heap_pos=n; }
+    for(int i=nnodes/2-1;i>=0;i--) ll_down(i);
+  }
+  cl.next_report=now-now%cl.period+cl.period;
+}
+
+static void jiq_push(int n){
+  if(nodes[n].in_jiq) return;
+  nodes[n].in_jiq=true;
+  jiq[(cl.jiq_head+cl.jiq_len++)%nnodes]=n;
+}
+
+// Choose the node for a newly arrived job.
+static int dispatch(void){
+  if(now>=cl.next_report) load_report();
+  int n;
+  switch(cl.policy){
+  case DISP_PO2: {
+    int a=rand_node(), b=rand_node();
+    n = nodes[b].seen<nodes[a].seen ? b : a;
+    break;
+  }
+  case DISP_LEAST: n=ll_heap[0]; break;
+  case DISP_JIQ:
+    if(cl.jiq_len){
+      n=jiq[cl.jiq_head]; cl.jiq_head=(cl.jiq_head+1)%nnodes; cl.jiq_len--;
+      nodes[n].in_jiq=false;
+      break;
     }
+    cl.jiq_misses++;
+    n=rand_node();
+    break;
+  default: n=rand_node(); break;
+  }
+  nodes[n].seen++;
+  if(cl.policy==DISP_LEAST) ll_down(nodes[n].heap_pos);
+  nodes[n].dispatched++;
+  return n;
+}
 
-    // Skip to next separator
-    while(*s && *s!=';') s++;
-    if(*s==';') s++;
+// Thread groups, one per job with threads=K (see "Thread groups" below).
+// Threads name theirs by index, so records are pooled in a growing array and
+// recycled through a free list when a job's last thread exits.
+typedef struct {
+  int live;                            // Threads not exited yet
+  int arrived;                         // Blocked at the current barrier
+  int barrier_ms;                      // Work between barriers, 0 = none
+  int node;                            // Cluster node of every thread
+  int next_free;                       // Free-list link while unused
+  long long arrive_ms;                 // Job arrival, for job turnaround
+  long long first_ms;                  // First arrival at the current barrier
+  queue_t waiters;                     // Threads blocked at the barrier
+} tgroup_t;
+#define MAX_THREADS 1000000
+static tgroup_t *tgs;
+static int ntgs, tgs_cap, tg_free=-1;
+
+// Choose the CPU for a new or woken process (select_cpu()). In cluster mode
+// a new job is first dispatched to a node, which it reaches after the
+// dispatch delay; pinned jobs go straight to their CPUs' node, and the
+// threads of a job all go to the node of its first. Returns false while the
+// job is still on its way.
+static bool place_proc(proc_t *p){
+  if(p->node<0 && nnodes>1 && !p->aff){
+    tgroup_t *g = p->tg>=0 ? &tgs[p->tg] : NULL;
+    if(g && g->node>=0) p->node=g->node;
+    else {
+      p->node=dispatch();
+      if(g) g->node=p->node;
+    }
+    nodes[p->node].jobs++;
+    if(cl.delay){ ev_push(now+cl.delay, EV_ARRIVAL, 0, p); return false; }
   }
+  if(ncpus>1) p->cpu=select_cpu(p);
+  if(p->node<0){ p->node=cpus[p->cpu].node; nodes[p->node].jobs++; }
+  return true;
 }
 
-// Book-keeping for one tick of CPU time: decrease remaining work and quantum,
-// and print a line the visualizer will parse.
-static void on_tick(proc_t *p){
-  p->work_left -= TICK_MS;
-  p->ticks_left -= 1;
-  printf("Process %s %d has consumed %d ms in L%d\n", p->name, p->pid, TICK_MS, p->level);
+// Add a new or woken process to the run queues of its CPU.
+static void wake_proc(proc_t *p){
+  if(place_proc(p)) q_push(proc_q(p),p);
 }
 
-// Free a process and announce exit. In a real OS you'd transition to ZOMBIE
-// and reap later; here we just free immediately after logging.
-static void proc_exit(proc_t *p){
-  printf("Process %s %d EXIT\n", p->name, p->pid);
-  free(p);
+// Arrivals that fall inside the current tick (mid-tick wakeups only). They
+// are placed by wake_pending() once every CPU has picked.
+static struct { proc_t **p; int len, cap; } wk;
+
+static void arrive(proc_t *p){
+  if(p->arrive_ms<=now*TICK_MS){ wake_proc(p); return; }
+  if(wk.len==wk.cap){
+    wk.cap = wk.cap ? 2*wk.cap : 64;
+    wk.p = realloc(wk.p, wk.cap*sizeof *wk.p);
+    if(!wk.p){ perror("realloc"); exit(1); }
+  }
+  wk.p[wk.len++]=p;
 }
 
-// Run exactly one tick of CPU time:
-//   1) Pick from highest non-empty queue (L0 -> L1 -> L2)
-//   2) Ensure the process has a non-zero quantum for its current level
-//   3) Account for the tick (reduce work/ticks_left and print a log line)
-//   4) If finished, EXIT; otherwise re-enqueue (RR) and demote if slice expired
-static void schedule_one_tick(void){
-  proc_t *p=NULL; int qid=-1;
+// ---------------------------------------------------------------------------
+// Locks ("spin 500 lock=A hold=20 every=100")
+//
+// A job with lock=A takes mutex A for hold ms of its CPU work, once at its
+// start or, with every=E, after every E ms of work outside. Locks are taken
+// when the job is picked: if A is held the job blocks (it leaves the run
+// queues) and the CPU picks again. On release the lock goes straight to the
+// waiter of the best level (FIFO among equals), which is woken.
+//
+// With --pi (priority inheritance) an owner that has a waiter of a better
+// level runs at that level, without being demoted, until it releases the
+// lock. A lock is inverted while a waiter is better than the owner's own
+// level and the owner does not run; --stats reports per-lock wait times and
+// the time spent inverted.
+// ---------------------------------------------------------------------------
+
+#define MAX_LOCKS 64
+typedef struct {
+  char name[16];
+  proc_t *owner;
+  queue_t waiters;                     // Blocked on the lock, in arrival order
+  long long acquired, contended, boosts;
+  hist_t wait;                         // Request to ownership, ms
+  long long inv_ticks, inv_cur, inv_max, inv_eps;  // Inverted ticks/episodes
+} lock_t;
+static lock_t locks[MAX_LOCKS];
+static int nlocks;
+static long long nr_blocked;           // Waiting on locks or at barriers
+static bool lock_pi=false;             // --pi
+
+static int lock_get(const char *name, int len){
+  for(int i=0;i<nlocks;i++)
+    if((int)strlen(locks[i].name)==len && !strncmp(locks[i].name,name,len)) return i;
+  if(nlocks==MAX_LOCKS || len>=(int)sizeof locks[0].name){
+    fprintf(stderr,"mlfqsim: lock %.*s: more than %d locks or name over %d characters; ignored\n",
+            len,name,MAX_LOCKS,(int)sizeof locks[0].name-1);
+    return -1;
+  }
+  lock_t *l=&locks[nlocks];
+  memset(l,0,sizeof *l);
+  snprintf(l->name,sizeof l->name,"%.*s",len,name);
+  return nlocks++;
+}
 
-  // 1) Highest non-empty queue first
-  if(L0.head){ p=q_pop(&L0); qid=0; p->ticks_left = p->ticks_left ? p->ticks_left : Q_L0; }
-  else if(L1.head){ p=q_pop(&L1); qid=1; p->ticks_left = p->ticks_left ? p->ticks_left : Q_L1; }
-  else if(L2.head){ p=q_pop(&L2); qid=2; p->ticks_left = p->ticks_left ? p->ticks_left : Q_L2; }
+static void proc_lock(proc_t *p, const jobspec_t *u){
+  if(u->lock<0) return;
+  p->lock=u->lock;
+  p->hold_ms=u->hold_ms>0 ? u->hold_ms : TICK_MS;
+  p->every_ms=u->every_ms;
+  p->lock_in=p->every_ms*1000LL;
+}
+
+// Priority inheritance: lift l's owner to the best level among its waiters.
+// The owner is either queued or picked by its CPU for this tick.
+static void lock_boost(lock_t *l){
+  proc_t *o=l->owner;
+  int best=o->level;
+  for(proc_t *w=l->waiters.head;w;w=w->next) if(w->level<best) best=w->level;
+  if(best==o->level) return;
+  if(o->boost<0) o->boost=o->level;
+  l->boosts++;
+  const cpu_t *c=&cpus[o->cpu];
+  bool queued = c->curr!=o && c->wakee!=o;
+  if(queued) q_remove(proc_q(o),o);
+  o->level=best;
+  o->ticks_left=nice_slice(o->nice,quantum[best]);
+  if(queued) q_push(proc_q(o),o);
+}
+
+// Called when p is about to run. True if it may: it wants no lock right now
+// or gets it. Otherwise p now waits on the lock (arriving at at_ms).
+static bool lock_acquire(proc_t *p, long long at_ms){
+  if(p->lock<0 || p->lock_in) return true;
+  lock_t *l=&locks[p->lock];
+  if(!l->owner){
+    l->owner=p; l->acquired++;
+    hist_add(&l->wait,0);
+    p->lock_in=-1; p->crit_left=p->hold_ms*1000LL;
+    return true;
+  }
+  l->contended++;
+  p->blocked_ms=at_ms;
+  if(!l->waiters.head) l->waiters.head=p; else l->waiters.tail->next=p;
+  l->waiters.tail=p; l->waiters.len++;
+  nr_blocked++;
+  if(lock_pi) lock_boost(l);
+  return false;
+}
+
+// Owner o leaves its critical section (at the end of this tick, or exits).
+// The best waiter becomes the owner and is woken for the next tick.
+static void lock_release(proc_t *o){
+  lock_t *l=&locks[o->lock];
+  if(o->boost>=0){
+    o->level=o->boost; o->boost=-1;
+    o->ticks_left=nice_slice(o->nice,quantum[o->level]);
+  }
+  o->crit_left=0;
+  o->lock_in = o->every_ms ? o->every_ms*1000LL : -1;
+  l->owner=NULL;
+  proc_t *w=NULL, *wprev=NULL;
+  for(proc_t *prev=NULL, *x=l->waiters.head; x; prev=x, x=x->next)
+    if(!w || x->level<w->level){ w=x; wprev=prev; }
+  if(!w) return;
+  if(wprev) wprev->next=w->next; else l->waiters.head=w->next;
+  if(l->waiters.tail==w) l->waiters.tail=wprev;
+  l->waiters.len--;
+  w->next=NULL;
+  nr_blocked--;
+  long long t=(now+1)*TICK_MS;
+  l->owner=w; l->acquired++;
+  hist_add(&l->wait,(uint64_t)(t-w->blocked_ms));
+  w->lock_in=-1; w->crit_left=w->hold_ms*1000LL;
+  w->woken_ms=t;
+  wake_proc(w);
+  if(lock_pi && l->waiters.head) lock_boost(l);
+}
+
+// Account done us of p's work against its critical sections.
+static void lock_progress(proc_t *p, long long done){
+  if(locks[p->lock].owner==p){
+    if((p->crit_left-=done)<=0) lock_release(p);
+  } else if(p->lock_in>0 && (p->lock_in-=done)<=0) p->lock_in=0;
+}
+
+// ---------------------------------------------------------------------------
+// Thread groups ("spin 1000 threads=8 barrier=50")
+//
+// A job with threads=K is K processes that each do the job's work and, with
+// barrier=N, meet after every N ms of it: a thread that reaches the barrier
+// blocks off the run queues until every live thread of its job has, and the
+// last one to arrive wakes the rest. The job thus runs at the pace of its
+// slowest thread each phase; --stats reports job turnaround, how far the
+// last thread trailed the first at each barrier, and the share of thread
+// time spent waiting. A thread holding a lock passes its barrier only after
+// releasing it.
+// ---------------------------------------------------------------------------
+
+static int tg_new(int nthreads, int barrier_ms, long long at_ms){
+  int i;
+  if(tg_free>=0){ i=tg_free; tg_free=tgs[i].next_free; }
   else {
-    // No runnable process this tick (all done or waiting)
-    printf("Process idle 0 has consumed %d ms in IDLE\n", TICK_MS);
-    return;
+    if(ntgs==tgs_cap){
+      tgs_cap = tgs_cap ? 2*tgs_cap : 64;
+      tgs = realloc(tgs, tgs_cap*sizeof *tgs);
+      if(!tgs){ perror("realloc"); exit(1); }
+    }
+    i=ntgs++;
   }
+  tgs[i]=(tgroup_t){ .live=nthreads, .barrier_ms=barrier_ms, .node=-1, .next_free=-1, .arrive_ms=at_ms };
+  return i;
+}
 
-  // 3) Run for one tick
-  on_tick(p);
+// Everyone has reached g's barrier at t (ms): wake the waiters.
+static void tg_release(tgroup_t *g, long long t){
+  stats.thr.barriers++;
+  hist_add(&stats.thr.gap,(uint64_t)(g->arrived ? t-g->first_ms : 0));
+  proc_t *w=g->waiters.head;
+  g->waiters=(queue_t){0};
+  nr_blocked-=g->arrived;
+  g->arrived=0;
+  while(w){
+    proc_t *n=w->next;
+    w->next=NULL;
+    stats.thr.wait_ms+=t-w->blocked_ms;
+    w->woken_ms=t;
+    wake_proc(w);
+    w=n;
+  }
+}
 
-  // 4) Finished? Exit early.
-  if(p->work_left<=0){ proc_exit(p); return; }
+// Thread p reached its barrier at t (ms). True if it blocks there; the last
+// thread to arrive releases the others and carries on.
+static bool tg_barrier(proc_t *p, long long t){
+  tgroup_t *g=&tgs[p->tg];
+  p->bar_left=g->barrier_ms*1000;
+  if(g->arrived+1==g->live){ tg_release(g,t); return false; }
+  if(!g->arrived) g->first_ms=t;
+  g->arrived++;
+  nr_blocked++;
+  p->blocked_ms=t;
+  if(!g->waiters.head) g->waiters.head=p; else g->waiters.tail->next=p;
+  g->waiters.tail=p; g->waiters.len++;
+  return true;
+}
 
-  // Otherwise, perform RR and demotion as needed.
-  if(qid==0){ // L0
-    if(p->ticks_left>0){
-      // Still has slice: stay in L0, RR to tail
-      q_push(&L0,p);
-    } else {
-      // Slice expired: demote to L1 with fresh L1 slice
-      p->level=1; p->ticks_left=Q_L1; q_push(&L1,p);
+// Thread p exits at t (ms). Its job ends with its last thread; until then
+// the barrier may now be complete without it.
+static void tg_exit(proc_t *p, long long t){
+  tgroup_t *g=&tgs[p->tg];
+  stats.thr.life_ms+=t-p->arrive_ms;
+  if(--g->live){
+    if(g->arrived==g->live) tg_release(g,t);
+    return;
+  }
+  stats.thr.jobs++;
+  hist_add(&stats.thr.turn,(uint64_t)(t-g->arrive_ms));
+  g->next_free=tg_free; tg_free=p->tg;
+}
+
+// Once per tick, after every CPU ran: count inverted ticks and episodes.
+static void lock_tick(void){
+  for(int i=0;i<nlocks;i++){
+    lock_t *l=&locks[i];
+    bool inv=false;
+    if(l->waiters.head){
+      const proc_t *o=l->owner;
+      int own = o->boost>=0 ? o->boost : o->level;
+      const cpu_t *c=&cpus[o->cpu];
+      bool ran = c->run_pid==o->pid && c->run_last==now;
+      for(const proc_t *w=l->waiters.head;w && !ran && !inv;w=w->next) inv = w->level<own;
     }
-  } else if(qid==1){ // L1
-    if(p->ticks_left>0){
-      q_push(&L1,p);
-    } else {
-      p->level=2; p->ticks_left=Q_L2; q_push(&L2,p);
+    if(inv){ l->inv_ticks++; l->inv_cur++; }
+    else if(l->inv_cur){
+      l->inv_eps++;
+      if(l->inv_cur>l->inv_max) l->inv_max=l->inv_cur;
+      l->inv_cur=0;
     }
-  } else { // L2
-    if(p->ticks_left>0){
-      // RR within L2
-      q_push(&L2,p);
-    } else {
-      // L2 never demotes further; just refresh its L2 quantum
-      p->ticks_left=Q_L2; q_push(&L2,p);
+  }
+}
+
+// True if group g or one of its ancestors is throttled.
+static bool group_hidden(int g){
+  for(; g>=0; g=groups[g].parent) if(groups[g].throttled) return true;
+  return false;
+}
+
+// Take one process that may run on dst off src for migration: the head of
+// the lowest non-empty level, which is the least likely to be cache-hot.
+// Under --capacity-aware a fast CPU pulling from an efficient one takes the
+// highest level instead. Pinned processes are skipped using the CPUs' set
+// bitmaps; the queue is only walked when src holds both kinds.
+static proc_t* detach_one(int src, int dst){
+  uint64_t queued=cpus[src].queued_sets, ok=queued & cpus[dst].allowed_sets;
+  if(!ok) return NULL;
+  bool up=capacity_aware && cpus[dst].capacity>cpus[src].capacity;
+  for(int i=0;i<3;i++){
+    int l = up ? i : 2-i;
+    for(int g=0;g<ngroups;g++){
+      queue_t *q=cpu_q(src,g,l);
+      if(!q->head || group_hidden(g)) continue;
+      proc_t *p = ok==queued ? q_pop(q) : q_take(q,ok);
+      if(p) return p;
     }
   }
+  return NULL;
 }
 
-int main(int argc, char **argv){
-  // Accept a single string argument that contains a mini command list, e.g.:
-  //   "spin 10000 &; spin 200000 &; spin 3000000 &;"
-  const char *cmdline = (argc>=2)? argv[1] : "spin 10000 &; spin 200000 &; spin 3000000 &;";
-  userinit_spin(cmdline);
-
-  // A simple termination policy: if there are no runnable processes for more
-  // than ~10 ticks in a row, we exit. There's also a hard cap on total ticks
-  // to avoid accidental infinite loops while experimenting.
-  int idle=0, ticks=0;
-  while(1){
-    if(ticks>100000) break; // safety cap
-
-    if(!L0.head && !L1.head && !L2.head){
-      idle++; ticks++;
-      if(idle>10) break; // all done
-      printf("Process idle 0 has consumed %d ms in IDLE\n", TICK_MS);
-      continue;
+// Move a detached process to dst. A process that has run before pays the
+// migration penalty of the innermost domain the two CPUs share.
+static void attach(proc_t *p, int dst){
+  int d=cpu_domain(p->cpu,dst);
+  topo.migrations[d]++;
+  if(p->first_run>=0) p->work_left+=topo.penalty_us[d];
+  p->cpu=dst;
+  q_push(proc_q(p),p);
+}
+
+// Pull from the busiest CPU of cpu's domain d that holds something cpu may
+// run. Returns true if anything moved.
+static bool balance_domain(int cpu, int d){
+  const cpu_t *c=&cpus[cpu];
+  int busiest=-1, bn=cpus[cpu].g[0].nr+1;
+  for(int x=c->lo[d];x<c->hi[d];x++)
+    if(cpus[x].g[0].nr>bn && (cpus[x].queued_sets & c->allowed_sets)){ busiest=x; bn=cpus[x].g[0].nr; }
+  if(busiest<0) return false;
+  bool moved=false;
+  for(int k=(bn-cpus[cpu].g[0].nr)/2; k>0; k--){
+    proc_t *p=detach_one(busiest,cpu);
+    if(!p) break;
+    attach(p,cpu); moved=true;
+  }
+  return moved;
+}
+
+// Periodic balancing, once per tick before the CPUs run, on the nodes that
+// have an overloaded CPU.
+static void balance_tick(void){
+  for(int n=0;n<nnodes && nr_overloaded;n++){
+    const node_t *nd=&nodes[n];
+    for(int cpu=nd->lo;cpu<nd->hi && nd->overloaded;cpu++){
+      const cpu_t *c=&cpus[cpu];
+      for(int d=0;d<NDOMS;d++){
+        int span=c->hi[d]-c->lo[d];
+        if(span<2 || (d && span==c->hi[d-1]-c->lo[d-1])) continue;   // Degenerate
+        if((now+cpu)%span==0) balance_domain(cpu,d);
+      }
+    }
+  }
+}
+
+// Misfit pull: an idle fast CPU takes work from the busiest efficient CPU
+// in its package, even one with a single process queued.
+static bool misfit_pull(int cpu){
+  const cpu_t *c=&cpus[cpu];
+  int src=-1, sn=0;
+  for(int x=c->lo[DOM_PKG];x<c->hi[DOM_PKG];x++)
+    if(!cpu_fast(x) && cpus[x].g[0].nr>sn && (cpus[x].queued_sets & c->allowed_sets)){ src=x; sn=cpus[x].g[0].nr; }
+  if(src<0) return false;
+  proc_t *p=detach_one(src,cpu);
+  if(!p) return false;
+  topo.misfits++;
+  attach(p,cpu);
+  return true;
+}
+
+// Misfit push: p was just demoted to L2 on a fast CPU. If other work is
+// waiting here, move p to the least-loaded efficient CPU of the package
+// unless that one has more work queued; otherwise requeue it here.
+static void misfit_push(int cpu, proc_t *p){
+  const cpu_t *c=&cpus[cpu];
+  int dst=-1, dn=cpus[cpu].g[0].nr+1;
+  if(dn==1){ q_push(proc_q(p),p); return; }
+  for(int x=c->lo[DOM_PKG];x<c->hi[DOM_PKG];x++)
+    if(!cpu_fast(x) && cpus[x].g[0].nr<dn && cpu_allowed(x,p)){ dst=x; dn=cpus[x].g[0].nr; }
+  if(dst<0){ q_push(proc_q(p),p); return; }
+  topo.misfits++;
+  attach(p,dst);
+}
+
+// A CPU with nothing to run pulls from its closest domains first.
+static bool idle_balance(int cpu){
+  const node_t *nd=&nodes[cpus[cpu].node];
+  for(int d=0;d<DOM_NUMA && nd->overloaded;d++)
+    if(balance_domain(cpu,d)) return true;
+  if(capacity_aware && topo.asym && cpu_fast(cpu) && nr_ready) return misfit_pull(cpu);
+  return false;
+}
+
+// ---------------------------------------------------------------------------
+// Topology setup (--cpus, --topology)
+// ---------------------------------------------------------------------------
+
+typedef struct { int socket, llc, core, id, cap; } topo_ent_t;
+
+static int topo_cmp(const void *a, const void *b){
+  const topo_ent_t *x=a, *y=b;
+  if(x->socket!=y->socket) return x->socket<y->socket ? -1 : 1;
+  if(x->llc!=y->llc) return x->llc<y->llc ? -1 : 1;
+  if(x->core!=y->core) return x->core<y->core ? -1 : 1;
+  return x->id<y->id ? -1 : x->id>y->id;
+}
+
+// Recompute the capacity summary after CPU capacities change.
+static void topo_capacity(void){
+  int lo=cpus[0].capacity, hi=lo;
+  for(int c=1;c<ncpus;c++){
+    if(cpus[c].capacity<lo) lo=cpus[c].capacity;
+    if(cpus[c].capacity>hi) hi=cpus[c].capacity;
+  }
+  topo.cap_max=hi; topo.asym=lo!=hi;
+}
+
+static void cpu_init(cpu_t *c){
+  for(int g=0;g<MAX_GROUPS;g++) c->g[g]=(grq_t)GRQ_INIT;
+  memset(c->nr_level,0,sizeof c->nr_level);
+  c->opp=c->util=0; c->idle_from=0;
+  c->curr=c->wakee=NULL; c->curr_q=c->wake_ms=0;
+  c->run_pid=0; c->run_last=-1; c->run_from=0;
+  c->allowed_sets=1; c->queued_sets=0;
+  memset(c->nr_set,0,sizeof c->nr_set);
+  c->busy_ticks=0;
+}
+
+// Replace the machine with n CPUs laid out as in ent (any order). Must run
+// before any process exists.
+static void topo_build(topo_ent_t *ent, int n){
+  qsort(ent,n,sizeof *ent,topo_cmp);
+  if(cpus!=&cpu0) free(cpus);
+  cpus = n==1 ? &cpu0 : calloc(n,sizeof *cpus);
+  if(!cpus){ perror("calloc"); exit(1); }
+  ncpus=n;
+  // Dense ids in sorted order.
+  int s=-1, l=-1, k=-1;
+  for(int i=0;i<n;i++){
+    cpu_t *c=&cpus[i];
+    cpu_init(c);
+    if(!i || ent[i].socket!=ent[i-1].socket){ s++; l++; k++; }
+    else if(ent[i].llc!=ent[i-1].llc){ l++; k++; }
+    else if(ent[i].core!=ent[i-1].core) k++;
+    c->socket=s; c->llc=l; c->core=k; c->capacity=ent[i].cap; c->node=0;
+  }
+  nnodes=1;
+  nodes[0]=(node_t){ .hi=n };
+  for(int i=0;i<n;i++)
+    for(int d=0;d<NDOMS;d++){
+      int lo=i, hi=i+1;
+      while(lo>0 && cpu_domain(lo-1,i)<=d) lo--;
+      while(hi<n && cpu_domain(hi,i)<=d) hi++;
+      cpus[i].lo[d]=lo; cpus[i].hi[d]=hi;
     }
+  topo_capacity();
+}
+
+// Cluster mode: repeat the current machine n times as separate nodes.
+// Topology ids are offset so that no two nodes share any domain.
+MAIN_ONLY static void topo_nodes(int n){
+  int k=ncpus;
+  if(n<1 || (long long)n*k>MAX_CPUS){ fprintf(stderr,"nodes: 1..%d CPUs in total supported\n",MAX_CPUS); exit(1); }
+  if(n==1) return;
+  cpu_t *all=malloc((size_t)n*k*sizeof *all);
+  if(!all){ perror("malloc"); exit(1); }
+  int sockets=cpus[k-1].socket+1, llcs=cpus[k-1].llc+1, cores=cpus[k-1].core+1;
+  for(int j=0;j<n;j++){
+    nodes[j]=(node_t){ .lo=j*k, .hi=(j+1)*k };
+    for(int i=0;i<k;i++){
+      cpu_t *c=&all[j*k+i];
+      *c=cpus[i];
+      c->socket+=j*sockets; c->llc+=j*llcs; c->core+=j*cores; c->node=j;
+      for(int d=0;d<NDOMS;d++){ c->lo[d]+=j*k; c->hi[d]+=j*k; }
+    }
+  }
+  if(cpus!=&cpu0) free(cpus);
+  cpus=all; ncpus=n*k; nnodes=n;
+  for(int j=0;j<n;j++) jiq_push(j);
+}
+
+// Regular machine: sockets x cores x threads, llc cores per last-level cache.
+static void topo_regular(int sockets, int cores, int threads, int llc){
+  int n=sockets*cores*threads;
+  if(n<1 || n>MAX_CPUS){ fprintf(stderr,"topology: 1..%d CPUs supported\n",MAX_CPUS); exit(1); }
+  if(llc<1 || llc>cores) llc=cores;
+  topo_ent_t *ent=malloc(n*sizeof *ent);
+  if(!ent){ perror("malloc"); exit(1); }
+  for(int i=0;i<n;i++){
+    int c=i/threads%cores, s=i/threads/cores;
+    ent[i]=(topo_ent_t){ s, s*cores+c/llc, s*cores+c, i, 100 };
+  }
+  topo.sockets=sockets; topo.cores=cores; topo.threads=threads;
+  topo_build(ent,n);
+  free(ent);
+}
 
-    idle=0; ticks++;
-    schedule_one_tick();
+static int read_int_file(const char *path){
+  FILE *f=fopen(path,"r");
+  int v=-1;
+  if(f){ if(fscanf(f,"%d",&v)!=1) v=-1; fclose(f); }
+  return v;
+}
+
+// Layout of the machine we are running on, from sysfs. The LLC is named by
+// the first CPU sharing the highest cache index found. Capacities come from
+// cpu_capacity (hybrid and big.LITTLE machines; 1024 = the biggest CPU).
+static bool topo_sysfs(void){
+  topo_ent_t *ent=malloc(MAX_CPUS*sizeof *ent);
+  if(!ent){ perror("malloc"); exit(1); }
+  int n=0, cap_max=1;
+  char path[128];
+  for(int i=0;i<MAX_CPUS;i++){
+    snprintf(path,sizeof path,"/sys/devices/system/cpu/cpu%d/topology/physical_package_id",i);
+    int pkg=read_int_file(path);
+    if(pkg<0) continue;
+    snprintf(path,sizeof path,"/sys/devices/system/cpu/cpu%d/topology/core_id",i);
+    int core=read_int_file(path);
+    int llc=-1;
+    for(int idx=3;idx>=2 && llc<0;idx--){
+      snprintf(path,sizeof path,"/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",i,idx);
+      llc=read_int_file(path);
+    }
+    snprintf(path,sizeof path,"/sys/devices/system/cpu/cpu%d/cpu_capacity",i);
+    int cap=read_int_file(path);
+    if(cap<1) cap=1024;
+    if(cap>cap_max) cap_max=cap;
+    // Core ids repeat across packages; LLC ids are CPU numbers.
+    ent[n++]=(topo_ent_t){ pkg, llc>=0 ? llc : pkg, pkg*65536+core, i, cap };
+  }
+  for(int i=0;i<n;i++) ent[i].cap=(ent[i].cap*100+cap_max/2)/cap_max;
+  if(n){
+    topo_build(ent,n);
+    topo.sockets=cpus[n-1].socket+1;
+    topo.cores=(cpus[n-1].core+1)/topo.sockets;
+    topo.threads=n/(cpus[n-1].core+1);
+  }
+  free(ent);
+  return n>0;
+}
+
+// Topology file: "key value" lines, # comments.
+//   sockets N / cores N (per socket) / threads N (per core)
+//   llc N        cores sharing one last-level cache (default: all of a socket)
+//   sys          take the layout from /sys/devices/system/cpu instead
+//   penalty smt=MS llc=MS pkg=MS numa=MS   extra work per migration
+//   remote PCT   run time percentage away from the home socket (e.g. 130)
+//   smt PCT      speed of each SMT thread while its sibling is busy (e.g. 60)
+//   capacity PCT LIST   work per tick of the CPUs in LIST ("4-7,12"; CPU
+//                numbers as in the trace), in percent of a full tick
+//   opp MHZ:V ...        frequency/voltage table, enables the energy model
+//   cdyn NF      switched capacitance for P = C*V^2*f (default 1 nF)
+//   cstate NAME MW RESIDENCY_MS EXIT_US   one idle state, shallowest first
+MAIN_ONLY static bool topo_load(const char *path){
+  if(!strcmp(path,"sys")) return topo_sysfs();
+  FILE *f=fopen(path,"r");
+  if(!f){ perror(path); return false; }
+  int sockets=1, cores=1, threads=1, llc=0;
+  bool sys=false;
+  short *cap=NULL;                     // Per-CPU capacity, 0 = default
+  char line[256];
+  while(fgets(line,sizeof line,f)){
+    char *s=line;
+    while(*s==' '||*s=='\t') s++;
+    if(*s=='#' || *s=='\n' || !*s) continue;
+    if(!strncmp(s,"sockets",7)) sockets=atoi(s+7);
+    else if(!strncmp(s,"cores",5)) cores=atoi(s+5);
+    else if(!strncmp(s,"threads",7)) threads=atoi(s+7);
+    else if(!strncmp(s,"llc",3)) llc=atoi(s+3);
+    else if(!strncmp(s,"sys",3)) sys=true;
+    else if(!strncmp(s,"capacity",8)){
+      char *t=s+8;
+      int pct=(int)strtol(t,&t,10);
+      if(pct<1 || pct>1000){ fprintf(stderr,"%s: bad capacity: %s",path,s); fclose(f); free(cap); return false; }
+      if(!cap && !(cap=calloc(MAX_CPUS,sizeof *cap))){ perror("calloc"); exit(1); }
+      for(;;){
+        while(*t==' '||*t=='\t'||*t==',') t++;
+        if(*t<'0' || *t>'9') break;
+        int lo=(int)strtol(t,&t,10), hi=lo;
+        if(*t=='-') hi=(int)strtol(t+1,&t,10);
+        for(int c=lo;c<=hi && c<MAX_CPUS;c++) cap[c]=(short)pct;
+      }
+    }
+    else if(!strncmp(s,"smt",3)) topo.smt_pct=atoi(s+3);
+    else if(!strncmp(s,"opp",3)){
+      pm.nopp=0;
+      for(char *t=strtok(s+3," \t\n");t && pm.nopp<MAX_OPPS;t=strtok(NULL," \t\n")){
+        int mhz; double v;
+        if(sscanf(t,"%d:%lf",&mhz,&v)!=2 || mhz<1 || v<=0 || (pm.nopp && mhz<=pm.mhz[pm.nopp-1])){
+          fprintf(stderr,"%s: bad opp %s (MHZ:V, ascending)\n",path,t); fclose(f); free(cap); return false;
+        }
+        pm.mhz[pm.nopp]=mhz; pm.volt[pm.nopp]=v; pm.nopp++;
+      }
+    }
+    else if(!strncmp(s,"cdyn",4)) pm.cdyn_nf=atof(s+4);
+    else if(!strncmp(s,"cstate",6)){
+      if(pm.ncstates==MAX_CSTATES) continue;
+      cstate_t *c=&pm.cs[pm.ncstates];
+      if(sscanf(s+6,"%7s %lf %d %d",c->name,&c->mw,&c->residency_ms,&c->exit_us)!=4){
+        fprintf(stderr,"%s: bad cstate: %s",path,s); fclose(f); free(cap); return false;
+      }
+      pm.ncstates++;
+    }
+    else if(!strncmp(s,"remote",6)) topo.remote_pct=atoi(s+6);
+    else if(!strncmp(s,"penalty",7)){
+      for(char *t=strtok(s+7," \t\n");t;t=strtok(NULL," \t\n"))
+        for(int d=0;d<NDOMS;d++){
+          size_t k=strlen(dom_name[d]);
+          if(!strncmp(t,dom_name[d],k) && t[k]=='=') topo.penalty_us[d]=(long long)(atof(t+k+1)*1000);
+        }
+    } else {
+      fprintf(stderr,"%s: unknown line: %s",path,s);
+      fclose(f);
+      free(cap);
+      return false;
+    }
+  }
+  fclose(f);
+  if(topo.remote_pct<1) topo.remote_pct=100;
+  if(topo.smt_pct<1 || topo.smt_pct>100) topo.smt_pct=100;
+  if(sys){ if(!topo_sysfs()){ free(cap); return false; } }
+  else topo_regular(sockets,cores,threads,llc);
+  if(cap){
+    for(int c=0;c<ncpus;c++) if(cap[c]) cpus[c].capacity=cap[c];
+    free(cap);
+    topo_capacity();
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Energy model and frequency governors
+//
+// A busy tick at OPP o does mhz[o]/mhz[max] of the CPU's work and costs
+// P = C*V^2*f for TICK_MS. An idle CPU walks down the C-state ladder,
+// entering each deeper state once it has been idle for that state's target
+// residency; the process that wakes it pays the exit latency of the state
+// it reached as extra work. Idle energy is charged for the whole idle period
+// when the CPU next runs, so tickless idle stays O(1).
+//
+// The governor picks the OPP before every busy tick: performance (highest),
+// powersave (lowest) or schedutil, which keeps a frequency-invariant
+// PELT-style utilization per CPU (32 ms half-life) and asks for
+// 1.25 * f_max * util, rounded up to the next OPP.
+// ---------------------------------------------------------------------------
+
+#define UTIL_SCALE 1024
+#define UTIL_DECAY 824                 // 0.5^(TICK_MS/32) * UTIL_SCALE
+
+// Defaults for whatever the topology file left out: a laptop-class core.
+MAIN_ONLY static void pm_defaults(void){
+  static const int mhz[]={800,1400,2000,2600,3200};
+  static const double volt[]={0.70,0.80,0.90,1.00,1.10};
+  static const cstate_t cs[]={ {"C1",300,0,2}, {"C6",30,20,200} };
+  if(!pm.nopp){
+    pm.nopp=5;
+    memcpy(pm.mhz,mhz,sizeof mhz); memcpy(pm.volt,volt,sizeof volt);
+  }
+  if(!pm.ncstates){ pm.ncstates=2; memcpy(pm.cs,cs,sizeof cs); }
+}
+
+static double opp_watts(int o){ return pm.cdyn_nf*1e-3*pm.volt[o]*pm.volt[o]*pm.mhz[o]; }
+
+// Charge k idle ticks walking down the C-state ladder. Returns the deepest
+// state reached.
+static int pm_idle(long long k){
+  int deepest=0;
+  for(int i=0;i<pm.ncstates;i++){
+    long long from = i ? pm.cs[i].residency_ms/TICK_MS : 0;
+    long long to = i+1<pm.ncstates ? pm.cs[i+1].residency_ms/TICK_MS : k;
+    if(from>=k) break;
+    if(to>k) to=k;
+    if(to<=from) continue;
+    deepest=i;
+    pm.cs_ticks[i]+=to-from;
+    pm.idle_j+=pm.cs[i].mw*1e-3*(to-from)*TICK_MS*1e-3;
+  }
+  return deepest;
+}
+
+// cpu is about to run p for a tick: settle the idle period that ends here,
+// let the governor choose the OPP and charge the tick's energy.
+static void pm_busy(int cpu, proc_t *p){
+  cpu_t *c=&cpus[cpu];
+  long long k=now-c->idle_from;
+  if(k>0){
+    int s=pm_idle(k);
+    if(pm.ncstates){ pm.wakeups[s]++; p->work_left+=pm.cs[s].exit_us; }
+    for(long long i=0;i<k && c->util;i++) c->util=c->util*UTIL_DECAY/UTIL_SCALE;
+  }
+  c->idle_from=now+1;
+  int top=pm.nopp-1, o=top;
+  if(governor==GOV_POWERSAVE) o=0;
+  else if(governor==GOV_SCHEDUTIL){
+    long long want=(long long)pm.mhz[top]*c->util*5/4/UTIL_SCALE;
+    for(o=0;o<top && pm.mhz[o]<want;o++);
+  }
+  c->opp=o;
+  pm.busy_j+=opp_watts(o)*TICK_MS*1e-3;
+  pm.mhz_ticks+=pm.mhz[o];
+  long long contrib=(long long)UTIL_SCALE*pm.mhz[o]/pm.mhz[top];
+  c->util=(int)((c->util*(long long)UTIL_DECAY + contrib*(UTIL_SCALE-UTIL_DECAY))/UTIL_SCALE);
+}
+
+// Charge every CPU's idle period so far, for reporting.
+static void pm_settle(void){
+  for(int c=0;c<ncpus;c++){
+    if(now>cpus[c].idle_from) pm_idle(now-cpus[c].idle_from);
+    cpus[c].idle_from=now;
+  }
+}
+
+// Helper to check the command name; illustrative here (not strictly needed).
+__attribute__((unused)) static bool is_spin(const char *s){return strncmp(s,"spin",4)==0;}
+
+// proc_t keeps these in narrow fields; the parsers clamp nice and the
+// tables that hand out the indexes are bounded to fit.
+_Static_assert(NICE_MIN>=INT8_MIN && NICE_MAX<=INT8_MAX, "nice is an int8_t");
+_Static_assert(MAX_GROUPS<=UINT8_MAX+1 && MAX_CPUSETS<=UINT8_MAX+1, "grp and aff are uint8_t");
+_Static_assert(MAX_LOCKS<=INT8_MAX, "lock is an int8_t");
+_Static_assert(MAX_CPUS<=INT16_MAX, "home (a socket id) is an int16_t");
+
+// Create a process arriving at at_ms in group grp and affinity set aff. It
+// starts at the level its nice value maps to, with that level's quantum.
+static proc_t* make_proc(const char*name,int ms,long long at_ms,int nice,int grp,int aff){
+  PROF_BEGIN(PROF_ALLOC);
+  proc_t *p=calloc(1,sizeof(*p));
+  PROF_END(PROF_ALLOC);
+  p->pid=next_pid++;
+  snprintf(p->name,sizeof(p->name),"%s",name);
+  p->work_left=ms*1000LL;
+  p->nice=nice;
+  p->grp=grp;
+  p->aff=aff;
+  p->node=-1;
+  p->home=-1;
+  p->level=nice_level(nice);  // start at top level unless niced
+  p->ticks_left=nice_slice(nice,quantum[p->level]); // initialize its quantum
+  p->arrive_ms=at_ms;
+  p->woken_ms=at_ms;
+  p->lock=-1;
+  p->boost=-1;
+  p->tg=-1;
+  p->fk=-1;
+  p->fork_in=-1;
+  p->fam=-1;
+  p->work_ms=ms;
+  p->first_run=-1;
+  return p;
+}
+
+// Wake a made process; processes that arrive later wait in the event heap
+// until their arrival tick.
+static void proc_start(proc_t *p){
+  if(p->arrive_ms<=0) wake_proc(p);
+  else ev_push(last_arrival=arrival_tick(p->arrive_ms), EV_ARRIVAL, 0, p);
+}
+
+// ---------------------------------------------------------------------------
+// Fork trees ("spin 1000 fork=4x spin 200 fork-at=100 wait")
+//
+// A job with fork=Kx spin MS creates K children of MS ms each once it has
+// done fork-at ms of its own work (default: after it first runs), outside
+// any critical section it holds. Children are new processes with the
+// parent's nice value, group, affinity and node: with child=l0 (the
+// default) they enter at the level their nice value maps to like any new
+// job, with child=inherit at the parent's current level. A parent with wait
+// blocks off the run queues until its last child exits, then runs the rest
+// of its work; one that finishes first just exits. With depth=D the
+// children fork the same way, D levels deep.
+//
+// Specs are interned in a small table (a process keeps only an index); the
+// family of a waiting parent is pooled by index like thread groups.
+// ---------------------------------------------------------------------------
+
+#define MAX_FORKS 64
+_Static_assert(MAX_FORKS<=INT8_MAX, "proc_t's fk is an int8_t");
+#define MAX_CHILDREN 100000
+static forkspec_t forks[MAX_FORKS];
+static int nforks;
+
+typedef struct {
+  int live;                            // Children not exited yet
+  int next_free;                       // Free-list link while unused
+  queue_t parent;                      // The blocked parent (one entry)
+} family_t;
+static family_t *fams;
+static int nfams, fams_cap, fam_free=-1;
+
+// Intern js's fork spec, depth levels deep. -1 if it forks nothing or the
+// table is full.
+static int fork_get(const jobspec_t *js){
+  if(js->fork.count<=0 || js->fork.child_ms<=0) return -1;
+  int fk=-1;
+  for(int d=0;d<(js->depth>1 ? js->depth : 1);d++){
+    forkspec_t f=js->fork;
+    f.next=fk;
+    for(fk=0;fk<nforks;fk++){
+      const forkspec_t *g=&forks[fk];
+      if(g->count==f.count && g->child_ms==f.child_ms && g->at_ms==f.at_ms && g->next==f.next &&
+         g->wait==f.wait && g->inherit==f.inherit) break;
+    }
+    if(fk==MAX_FORKS){
+      fprintf(stderr,"mlfqsim: more than %d distinct fork specs; fork ignored\n",MAX_FORKS);
+      return -1;
+    }
+    if(fk==nforks) forks[nforks++]=f;
+  }
+  return fk;
+}
+
+static void proc_fork_at(proc_t *p, int fk){
+  p->fk=fk;
+  p->fork_in = fk<0 ? -1 : forks[fk].at_ms*1000;
+}
+
+static int fam_new(int live){
+  int i;
+  if(fam_free>=0){ i=fam_free; fam_free=fams[i].next_free; }
+  else {
+    if(nfams==fams_cap){
+      fams_cap = fams_cap ? 2*fams_cap : 64;
+      fams = realloc(fams, fams_cap*sizeof *fams);
+      if(!fams){ perror("realloc"); exit(1); }
+    }
+    i=nfams++;
+  }
+  fams[i]=(family_t){ .live=live, .next_free=-1 };
+  return i;
+}
+
+// p reached its fork point at t (ms): create its children. Returns the
+// family p must now wait on, or -1.
+static int proc_fork(proc_t *p, long long t){
+  const forkspec_t *f=&forks[p->fk];
+  int fam = f->wait && p->work_left>0 ? fam_new(f->count) : -1;
+  stats.fork.forks++;
+  stats.fork.children+=f->count;
+  for(int i=0;i<f->count;i++){
+    proc_t *c=make_proc("spin",f->child_ms,t,p->nice,p->grp,p->aff);
+    if(f->inherit){
+      c->level = p->boost>=0 ? p->boost : p->level;
+      c->ticks_left=nice_slice(c->nice,quantum[c->level]);
+    }
+    c->fam=fam;
+    c->child=true;
+    proc_fork_at(c,f->next);
+    c->cpu=p->cpu;
+    c->node=p->node;
+    nodes[c->node].jobs++;
+    wake_proc(c);
+  }
+  return fam;
+}
+
+// p blocks on family fam from t (ms) until its children have exited.
+static void fam_wait(proc_t *p, int fam, long long t){
+  p->blocked_ms=t;
+  nr_blocked++;
+  fams[fam].parent=(queue_t){ p, p, 1 };
+}
+
+// Child c of a waiting parent exits at t (ms); the last one wakes it.
+static void fam_exit(proc_t *c, long long t){
+  family_t *f=&fams[c->fam];
+  if(--f->live) return;
+  proc_t *p=f->parent.head;
+  f->parent=(queue_t){0};
+  hist_add(&stats.fork.wait,(uint64_t)(t-p->blocked_ms));
+  nr_blocked--;
+  p->woken_ms=t;
+  f->next_free=fam_free; fam_free=c->fam;
+  wake_proc(p);
+}
+
+// Create one job: a single process, or js->threads threads of a new thread
+// group. Jobs from the workload are started by proc_start(), generated ones
+// arrive() in the current tick.
+static void new_job(const char *name, int ms, long long at_ms, int nice, int grp, int aff,
+                    const jobspec_t *js, bool generated){
+  int n = js->threads>1 ? js->threads : 1;
+  int tg = n>1 ? tg_new(n,js->barrier_ms,at_ms) : -1;
+  for(int i=0;i<n;i++){
+    proc_t *p=make_proc(name,ms,at_ms,nice,grp,aff);
+    proc_lock(p,js);
+    proc_fork_at(p,js->fk);
+    p->tg=tg;
+    if(tg>=0) p->bar_left=js->barrier_ms*1000;
+    if(generated) arrive(p); else proc_start(p);
+  }
+}
+
+// Parse a decimal integer and advance the cursor past it.
+static long long parse_int(const char **sp){
+  const char *s=*sp; long long v=0;
+  while(*s>='0'&&*s<='9') { v = v*10 + (*s-'0'); s++; }
+  *sp=s;
+  return v;
+}
+
+// Parse "nice=N" (N may be negative) or "prio=P" at *sp into *nice, clamped
+// to NICE_MIN..NICE_MAX. Returns false if neither key is there.
+static bool parse_nice(const char **sp, int *nice){
+  const char *s=*sp; long long v; bool neg=false;
+  if(strncmp(s,"nice=",5)==0){
+    s+=5;
+    if(*s=='-'){ neg=true; s++; }
+    v=parse_int(&s);
+    if(neg) v=-v;
+  } else if(strncmp(s,"prio=",5)==0){
+    s+=5;
+    v=parse_int(&s)-120;
+  } else return false;
+  *nice = v<NICE_MIN ? NICE_MIN : v>NICE_MAX ? NICE_MAX : (int)v;
+  if(*nice!=v) fprintf(stderr,"mlfqsim: %.*s out of range, using nice %d\n",(int)(s-*sp),*sp,*nice);
+  *sp=s;
+  return true;
+}
+
+// Register a generator and schedule its first arrival.
+static void new_gen(long long count, int mean_ms, int mean_gap_ms, long long at_ms, int nice, int grp, int aff,
+                    jobspec_t js){
+  if(ngens==MAX_GEN || count<=0 || mean_ms<=0) return;
+  gens[ngens]=(gen_t){ count, mean_ms, mean_gap_ms, at_ms, nice, grp, aff, js };
+  ev_push(arrival_tick(at_ms), EV_GEN, ngens, NULL);
+  ngens++;
+}
+
+// Parse "group=/path" at *sp into a group index (created on first use).
+static bool parse_group(const char **sp, int *grp){
+  const char *s=*sp;
+  if(strncmp(s,"group=",6)) return false;
+  s+=6;
+  const char *e=s;
+  while(*e && *e!=';' && *e!=' ' && *e!='\t' && *e!='&') e++;
+  *grp=group_get(s,(int)(e-s));
+  *sp=e;
+  return true;
+}
+
+// Parse "cpus=LIST" at *sp (e.g. "cpus=0-3,8", CPU numbers as in the trace)
+// into an affinity set index.
+static bool parse_cpus(const char **sp, int *aff){
+  const char *s=*sp;
+  if(strncmp(s,"cpus=",5)) return false;
+  s+=5;
+  const char *spec=s;
+  uint64_t w[MASK_WORDS]={0};
+  for(;;){
+    if(*s<'0' || *s>'9') break;
+    long long lo=parse_int(&s), hi=lo;
+    if(*s=='-'){ s++; hi=parse_int(&s); }
+    for(long long c=lo;c<=hi && c<ncpus;c++) w[c/64]|=1ULL<<(c%64);
+    if(*s!=',') break;
+    s++;
+  }
+  *aff=cpuset_get(w,spec,(int)(s-spec));
+  *sp=s;
+  return true;
+}
+
+// Parse "lock=NAME", "hold=MS" or "every=MS" at *sp into *u.
+static bool parse_lock(const char **sp, jobspec_t *u){
+  const char *s=*sp;
+  if(!strncmp(s,"lock=",5)){
+    s+=5;
+    const char *e=s;
+    while(*e && *e!=';' && *e!=' ' && *e!='\t' && *e!='&') e++;
+    u->lock=lock_get(s,(int)(e-s));
+    s=e;
+  }
+  else if(!strncmp(s,"hold=",5)){ s+=5; u->hold_ms=(int)parse_int(&s); }
+  else if(!strncmp(s,"every=",6)){ s+=6; u->every_ms=(int)parse_int(&s); }
+  else return false;
+  *sp=s;
+  return true;
+}
+
+// Parse "threads=K" or "barrier=MS" at *sp into *u.
+static bool parse_threads(const char **sp, jobspec_t *u){
+  const char *s=*sp;
+  if(!strncmp(s,"threads=",8)){
+    s+=8;
+    long long k=parse_int(&s);
+    u->threads = k<1 ? 1 : k>MAX_THREADS ? MAX_THREADS : (int)k;
+  }
+  else if(!strncmp(s,"barrier=",8)){
+    s+=8;
+    long long ms=parse_int(&s);
+    u->barrier_ms = ms>2000000 ? 2000000 : (int)ms;  // bar_left is an int of us
+  }
+  else return false;
+  *sp=s;
+  return true;
+}
+
+// Parse "fork=Kx spin MS", "fork-at=MS", "depth=D", "child=l0|inherit" or
+// "wait" at *sp into *u.
+static bool parse_fork(const char **sp, jobspec_t *u){
+  const char *s=*sp;
+  if(!strncmp(s,"fork=",5)){
+    s+=5;
+    long long k=parse_int(&s);
+    if(*s=='x') s++;
+    while(*s==' '||*s=='\t') s++;
+    if(!strncmp(s,"spin",4)) s+=4;
+    while(*s==' '||*s=='\t') s++;
+    long long ms=parse_int(&s);
+    u->fork.count = k>MAX_CHILDREN ? MAX_CHILDREN : (int)k;
+    u->fork.child_ms = ms>2000000 ? 2000000 : (int)ms;
+  }
+  else if(!strncmp(s,"fork-at=",8)){
+    s+=8;
+    long long ms=parse_int(&s);
+    u->fork.at_ms = ms>2000000 ? 2000000 : (int)ms;  // fork_in is an int of us
+  }
+  else if(!strncmp(s,"depth=",6)){
+    s+=6;
+    long long d=parse_int(&s);
+    u->depth = d<1 ? 1 : d>MAX_FORKS ? MAX_FORKS : (int)d;
+  }
+  else if(!strncmp(s,"child=inherit",13)){ s+=13; u->fork.inherit=true; }
+  else if(!strncmp(s,"child=l0",8) || !strncmp(s,"child=L0",8)){ s+=8; u->fork.inherit=false; }
+  else if(!strncmp(s,"wait",4) && (!s[4] || s[4]==' ' || s[4]=='\t' || s[4]==';' || s[4]=='&')){
+    s+=4; u->fork.wait=true;
+  }
+  else return false;
+  *sp=s;
+  return true;
+}
+
+// Parse a tiny subset of shell-like input to create spin processes.
+// Example accepted input: "spin 10000 &; spin 200000 at=500 &; spin 3000000 &;"
+// We ignore separators like '&' and ';' and only look for:
+//   spin <integer> [at=<ms>] [nice=<n>|prio=<p>] [group=<path>] [cpus=<list>]
+//   gen <count> <mean-ms> [gap=<mean-ms>] [at=<ms>] [nice=<n>|prio=<p>] [group=<path>] [cpus=<list>]
+//   group <path> [weight=<w>] [quota=<ms>] [period=<ms>]
+static void userinit_spin(const char *cmd){
+  const char *s=cmd;
+  while(*s){
+    // Skip whitespace and separators
+    while(*s==' '||*s=='\t'||*s==';'||*s=='&') s++;
+    if(!*s) break;
+
+    // Recognize the command name
+    if(strncmp(s,"spin",4)==0){
+      s += 4;
+      while(*s==' '||*s=='\t') s++;
+      // Parse decimal integer for work in ms
+      int ms = (int)parse_int(&s);
+      // Optional key=value modifiers up to the next separator
+      long long at = 0; int nice = 0, grp = 0, aff = 0;
+      jobspec_t js = { .lock=-1 };
+      while(*s && *s!=';'){
+        while(*s==' '||*s=='\t'||*s=='&') s++;
+        if(strncmp(s,"at=",3)==0){ s+=3; at=parse_int(&s); }
+        else if(parse_nice(&s,&nice) || parse_group(&s,&grp) || parse_cpus(&s,&aff) || parse_lock(&s,&js) ||
+                parse_threads(&s,&js) || parse_fork(&s,&js)) ;
+        else while(*s && *s!=';' && *s!=' ' && *s!='\t') s++;
+      }
+      js.fk=fork_get(&js);
+      if(ms>0) new_job("spin", ms, at, nice, grp, aff, &js, false);
+    } else if(strncmp(s,"gen",3)==0){
+      s += 3;
+      while(*s==' '||*s=='\t') s++;
+      long long count = parse_int(&s);
+      while(*s==' '||*s=='\t') s++;
+      int ms = (int)parse_int(&s);
+      long long at = 0; int gap = 0, nice = 0, grp = 0, aff = 0;
+      jobspec_t js = { .lock=-1 };
+      while(*s && *s!=';'){
+        while(*s==' '||*s=='\t'||*s=='&') s++;
+        if(strncmp(s,"at=",3)==0){ s+=3; at=parse_int(&s); }
+        else if(strncmp(s,"gap=",4)==0){ s+=4; gap=(int)parse_int(&s); }
+        else if(parse_nice(&s,&nice) || parse_group(&s,&grp) || parse_cpus(&s,&aff) || parse_lock(&s,&js) ||
+                parse_threads(&s,&js) || parse_fork(&s,&js)) ;
+        else while(*s && *s!=';' && *s!=' ' && *s!='\t') s++;
+      }
+      js.fk=fork_get(&js);
+      new_gen(count, ms, gap, at, nice, grp, aff, js);
+    } else if(strncmp(s,"group",5)==0){
+      s += 5;
+      while(*s==' '||*s=='\t') s++;
+      const char *e=s;
+      while(*e && *e!=';' && *e!=' ' && *e!='\t' && *e!='&') e++;
+      group_t *gr=&groups[group_get(s,(int)(e-s))];
+      s=e;
+      while(*s && *s!=';'){
+        while(*s==' '||*s=='\t'||*s=='&') s++;
+        if(strncmp(s,"weight=",7)==0){
+          s+=7; long long w=parse_int(&s);
+          gr->weight = w<1 ? 1 : w>262144 ? 262144 : (int)w;
+        }
+        else if(strncmp(s,"quota=",6)==0){ s+=6; gr->quota_ms=(int)parse_int(&s); }
+        else if(strncmp(s,"period=",7)==0){ s+=7; gr->period_ms=(int)parse_int(&s); }
+        else while(*s && *s!=';' && *s!=' ' && *s!='\t') s++;
+      }
+    }
+
+    // Skip to next separator
+    while(*s && *s!=';') s++;
+    if(*s==';') s++;
+  }
+}
+
+// Book-keeping for ms of CPU time (a whole tick unless a mid-tick wakeup
+// splits it): decrease remaining work and print a line the visualizer will
+// parse. A tick does the CPU's capacity (in percent) worth of work; sharing
+// the core with a busy SMT sibling leaves smt_pct percent of that, and away
+// from its home socket a process gets only 100/remote_pct of it. With the
+// energy model the CPU's current frequency scales the result once more.
+static long long on_tick(int cpu, proc_t *p, bool contended, int ms){
+  PROF_BEGIN(PROF_ACCOUNT);
+  long long work=ms*1000LL;
+  if(cpus[cpu].capacity!=100) work=work*cpus[cpu].capacity/100;
+  if(pm.nopp) work=work*pm.mhz[cpus[cpu].opp]/pm.mhz[pm.nopp-1];
+  if(contended){
+    work=work*topo.smt_pct/100;
+    topo.contended_ticks++;
+  }
+  if(p->home<0) p->home=cpus[cpu].socket;
+  else if(p->home!=cpus[cpu].socket && topo.remote_pct!=100){
+    work=work*100/topo.remote_pct;
+    topo.remote_ticks++;
+  }
+  p->work_left -= work;
+  PROF_END(PROF_ACCOUNT);
+  PROF_BEGIN(PROF_TRACE);
+  if(trace){
+    if(ncpus>1) printf("Process %s %d has consumed %d ms in L%d on cpu %d\n", p->name, p->pid, ms, p->level, cpu);
+    else printf("Process %s %d has consumed %d ms in L%d\n", p->name, p->pid, ms, p->level);
+  }
+  PROF_END(PROF_TRACE);
+  return work;
+}
+
+// Return the dashboard window for tick t, merging windows when t is past
+// the last one.
+static dash_pt_t* dash_at(long long t){
+  while(t >= DASH_POINTS*dash.width){
+    for(int i=0;i<DASH_POINTS/2;i++){
+      dash_pt_t *a=&dash.pt[2*i], *b=&dash.pt[2*i+1], m=*a;
+      for(int l=0;l<3;l++){ m.len_sum[l]+=b->len_sum[l]; m.busy[l]+=b->busy[l]; }
+      m.idle+=b->idle;
+      dash.pt[i]=m;
+    }
+    memset(&dash.pt[DASH_POINTS/2],0,sizeof(dash_pt_t)*(DASH_POINTS/2));
+    dash.width*=2;
+  }
+  return &dash.pt[t/dash.width];
+}
+
+// Per-tick sample of queue lengths (taken on CPU 0's turn) plus what the CPU
+// ran (level<0 = idle).
+static void dash_tick(int cpu, int level){
+  dash_pt_t *d=dash_at(now);
+  if(!cpu) for(int l=0;l<3;l++) d->len_sum[l]+=level_len(l);
+  if(level>=0) d->busy[level]++; else d->idle++;
+}
+
+// Reservoir sampling (Algorithm R) of finished jobs.
+static void dash_job(const proc_t *p, long long turn_ms, long long resp_ms){
+  long long i=dash.jobs_seen++;
+  if(i>=DASH_JOBS){
+    dash.rng ^= dash.rng<<13; dash.rng ^= dash.rng>>7; dash.rng ^= dash.rng<<17;
+    i=(long long)(dash.rng % (uint64_t)(i+1));
+    if(i>=DASH_JOBS) return;
+  }
+  dash.job[i]=(dash_job_t){ p->pid, p->work_ms, turn_ms, resp_ms };
+}
+
+MAIN_ONLY static void dash_write(FILE *f){
+  fprintf(f,"# mlfqsim stats v1\n");
+  fprintf(f,"T %d %lld %lld %lld\n", TICK_MS, dash.width, now, stats.exited);
+  long long npts=(now+dash.width-1)/dash.width;
+  if(npts>DASH_POINTS) npts=DASH_POINTS;
+  for(long long i=0;i<npts;i++){
+    dash_pt_t *d=&dash.pt[i];
+    long long w = (i+1)*dash.width<=now ? dash.width : now-i*dash.width;
+    fprintf(f,"S %lld %lld %.3f %.3f %.3f %lld %lld %lld %lld\n", i*dash.width, w,
+            (double)d->len_sum[0]/w, (double)d->len_sum[1]/w, (double)d->len_sum[2]/w,
+            d->busy[0], d->busy[1], d->busy[2], d->idle);
+  }
+  fprintf(f,"L %lld %lld %lld %lld\n", stats.level_ticks[0], stats.level_ticks[1],
+          stats.level_ticks[2], stats.idle_ticks);
+  const hist_t *hs[2]={&stats.resp,&stats.turn}; const char *hn[2]={"resp","turn"};
+  for(int k=0;k<2;k++)
+    for(int b=0;b<HIST_BUCKETS;b++)
+      if(hs[k]->n[b])
+        fprintf(f,"H %s %llu %llu %llu\n", hn[k], (unsigned long long)hist_lower(b),
+                (unsigned long long)(b+1<HIST_BUCKETS ? hist_lower(b+1) : hist_lower(b)),
+                (unsigned long long)hs[k]->n[b]);
+  long long nj = dash.jobs_seen<DASH_JOBS ? dash.jobs_seen : DASH_JOBS;
+  for(long long i=0;i<nj;i++)
+    fprintf(f,"J %d %d %lld %lld\n", dash.job[i].pid, dash.job[i].work_ms,
+            dash.job[i].turn_ms, dash.job[i].resp_ms);
+}
+
+// Free a process and announce exit. In a real OS you'd transition to ZOMBIE
+// and reap later; here we just free immediately after logging.
+static void proc_exit(proc_t *p){
+  PROF_BEGIN(PROF_TRACE);
+  if(trace) printf("Process %s %d EXIT\n", p->name, p->pid);
+  PROF_END(PROF_TRACE);
+  PROF_COUNT(CNT_EXIT, 1);
+  if(ring) ring_put(RING_EXIT, (uint32_t)p->pid, p->level, 0);
+  if(p->lock>=0 && locks[p->lock].owner==p) lock_release(p);
+  if(p->tg>=0) tg_exit(p,(now+1)*TICK_MS);
+  if(p->fam>=0) fam_exit(p,(now+1)*TICK_MS);
+  stats.exited++;
+  long long turn=(now+1)*TICK_MS - p->arrive_ms;
+  long long resp=p->first_run - p->arrive_ms;
+  hist_add(&stats.turn,(uint64_t)turn);
+  if(p->child) hist_add(&stats.fork.turn,(uint64_t)turn);
+  groups[p->grp].exited++;
+  hist_add(&groups[p->grp].turn,(uint64_t)turn);
+  int tier=nice_tier(p->nice);
+  stats.tier[tier].exited++;
+  hist_add(&stats.tier[tier].turn,(uint64_t)turn);
+  if(!--nodes[p->node].jobs && nnodes>1) jiq_push(p->node);
+  cpusets[p->aff].exited++;
+  hist_add(&cpusets[p->aff].resp,(uint64_t)resp);
+  hist_add(&cpusets[p->aff].turn,(uint64_t)turn);
+  stats.cls[p->level].exited++;
+  hist_add(&stats.cls[p->level].resp,(uint64_t)resp);
+  hist_add(&stats.cls[p->level].turn,(uint64_t)turn);
+  if(dash_f) dash_job(p,turn,resp);
+  PROF_BEGIN(PROF_ALLOC);
+  free(p);
+  PROF_END(PROF_ALLOC);
+}
+
+// ---------------------------------------------------------------------------
+// Decision record / replay
+//
+// Every simulated tick ends in one decision: which pid ran and at which level
+// (pid 0 = idle). Consecutive identical decisions are run-length encoded as
+//   varint(run length) varint(pid) byte(level)
+// after an 8-byte magic, so a billion-tick run of a few long jobs records in
+// a handful of bytes. Replay reads the recorded stream one run at a time while
+// the new build produces its own decisions, so neither trace is ever held in
+// memory.
+// ---------------------------------------------------------------------------
+
+#define REC_MAGIC "MLFQREC1"
+#define REC_IDLE_LEVEL 0xff
+
+static FILE *rec_f;                    // --record output
+static struct { int pid, level; long long len; } rec_run;
+
+static FILE *rpl_f;                    // --replay input
+static struct {
+  int pid, level; long long left;      // Current recorded run
+  bool eof;
+  long long ticks, diverged, spans, pid_diffs, level_diffs, extra;
+  bool in_span;
+  long long first_tick; int first_pid, first_level, got_pid, got_level;
+} rpl = { .first_tick=-1 };
+
+static void put_varint(FILE *f, uint64_t v){
+  while(v>=0x80){ putc((int)(v&0x7f)|0x80, f); v>>=7; }
+  putc((int)v, f);
+}
+
+static bool get_varint(FILE *f, uint64_t *v){
+  uint64_t r=0; int c, shift=0;
+  do {
+    if((c=getc(f))==EOF || shift>63) return false;
+    r |= (uint64_t)(c&0x7f) << shift; shift+=7;
+  } while(c&0x80);
+  *v=r;
+  return true;
+}
+
+static void rec_flush(void){
+  if(!rec_run.len) return;
+  put_varint(rec_f,(uint64_t)rec_run.len);
+  put_varint(rec_f,(uint64_t)rec_run.pid);
+  putc(rec_run.level,rec_f);
+  rec_run.len=0;
+}
+
+// Load the next recorded run; false once the recording is exhausted.
+static bool rpl_next(void){
+  uint64_t len, pid; int lv;
+  if(rpl.eof || !get_varint(rpl_f,&len) || !get_varint(rpl_f,&pid) ||
+     (lv=getc(rpl_f))==EOF){ rpl.eof=true; return false; }
+  rpl.pid=(int)pid; rpl.level=lv; rpl.left=(long long)len;
+  return true;
+}
+
+// Compare n ticks of (pid, level) starting at tick against the recording.
+static void rpl_check(long long tick, int pid, int level, long long n){
+  while(n>0){
+    if(rpl.left==0 && !rpl_next()){ rpl.extra+=n; return; }
+    long long k = n<rpl.left ? n : rpl.left;
+    bool same = rpl.pid==pid && rpl.level==level;
+    rpl.ticks+=k;
+    if(!same){
+      if(rpl.first_tick<0){
+        rpl.first_tick=tick; rpl.first_pid=rpl.pid; rpl.first_level=rpl.level;
+        rpl.got_pid=pid; rpl.got_level=level;
+      }
+      rpl.diverged+=k;
+      if(rpl.pid!=pid) rpl.pid_diffs+=k; else rpl.level_diffs+=k;
+      if(!rpl.in_span) rpl.spans++;
+    }
+    rpl.in_span=!same;
+    rpl.left-=k; n-=k; tick+=k;
+  }
+}
+
+// Called once per decision (n>1 only for bulk idle in tickless mode).
+static void decision(long long tick, int pid, int level, long long n){
+  if(rec_f){
+    if(rec_run.len && (rec_run.pid!=pid || rec_run.level!=level)) rec_flush();
+    rec_run.pid=pid; rec_run.level=level; rec_run.len+=n;
+  }
+  if(rpl_f) rpl_check(tick,pid,level,n);
+}
+
+static void print_level(FILE *f, int pid, int level){
+  if(pid==0) fprintf(f,"idle");
+  else fprintf(f,"pid %d in L%d",pid,level);
+}
+
+MAIN_ONLY static void rpl_report(void){
+  long long missing=rpl.left;
+  while(rpl_next()) missing+=rpl.left;
+  fprintf(stderr,"replay: %lld ticks compared, %lld diverged (%.3f%%) in %lld spans\n",
+          rpl.ticks, rpl.diverged, rpl.ticks ? 100.0*rpl.diverged/rpl.ticks : 0.0, rpl.spans);
+  fprintf(stderr,"replay: %lld ticks ran another pid, %lld ran the same pid at another level\n",
+          rpl.pid_diffs, rpl.level_diffs);
+  if(missing || rpl.extra)
+    fprintf(stderr,"replay: length differs: %lld recorded ticks not reached, %lld extra ticks\n",
+            missing, rpl.extra);
+  if(rpl.first_tick>=0){
+    fprintf(stderr,"replay: first divergence at tick %lld (%lld ms): expected ",
+            rpl.first_tick, rpl.first_tick*TICK_MS);
+    print_level(stderr,rpl.first_pid,rpl.first_level);
+    fprintf(stderr,", got ");
+    print_level(stderr,rpl.got_pid,rpl.got_level);
+    fprintf(stderr,"\n");
+  } else if(!missing && !rpl.extra) {
+    fprintf(stderr,"replay: identical\n");
+  }
+}
+
+// Pick-next policy: dequeue from cpu's highest non-empty queue (L0 -> L1 ->
+// L2) and report which level it came from in *qid. With control groups the
+// queues are those of the group chosen by group_pick().
+static proc_t* pick_next(int cpu, int *qid){
+  queue_t *q=cpus[cpu].g[ngroups>1 ? group_pick(cpu) : 0].q;
+  if(q[0].head){ *qid=0; return q_pop(&q[0]); }
+  if(q[1].head){ *qid=1; return q_pop(&q[1]); }
+  if(q[2].head){ *qid=2; return q_pop(&q[2]); }
+  *qid=-1;
+  return NULL;
+}
+
+// Core scheduling (--core-sched): SMT siblings only run processes of the
+// same control group at the same time. The first sibling to pick this tick
+// sets the core's cookie; returns -1 if none has picked yet.
+static int core_cookie(int cpu){
+  for(int x=cpus[cpu].lo[DOM_SMT];x<cpu;x++)
+    if(cpus[x].curr) return cpus[x].curr->grp;
+  return -1;
+}
+
+// Pick under a cookie: only the cookie group's own queues on this CPU are
+// eligible. NULL means the CPU is forced idle.
+static proc_t* pick_cookie(int cpu, int cookie, int *qid){
+  if(group_hidden(cookie)) return NULL;
+  queue_t *q=cpus[cpu].g[cookie].q;
+  for(int l=0;l<3;l++)
+    if(q[l].head){ *qid=l; return q_pop(&q[l]); }
+  return NULL;
+}
+
+// 1) Pick what cpu runs this tick from its highest non-empty queue (L0 -> L1
+// -> L2). All CPUs pick before any of them runs, so the accounting below
+// knows which SMT siblings are busy.
+static void schedule_pick(int cpu){
+  int qid=-1, cookie=-1;
+  PROF_BEGIN(PROF_PICK);
+  proc_t *p;
+  do { // A process that blocks on its lock makes the CPU pick again
+    if(core_sched && (cookie=core_cookie(cpu))>=0){
+      p=pick_cookie(cpu,cookie,&qid);
+      if(!p && cpus[cpu].g[0].nr) topo.forced_idle++;
+    } else {
+      p=pick_next(cpu,&qid);
+      if(!p && ncpus>1 && nr_ready && idle_balance(cpu)) p=pick_next(cpu,&qid);
+    }
+  } while(p && !lock_acquire(p,now*TICK_MS));
+  PROF_END(PROF_PICK);
+  cpu_t *c=&cpus[cpu];
+  c->curr=p; c->curr_q=qid;
+  if(p && (p->pid!=c->run_pid || c->run_last!=now-1)) c->run_from=now*TICK_MS;
+}
+
+// True if another SMT thread of cpu's core is running something this tick.
+// Siblings that already ran their tick have curr cleared but run_last==now.
+static bool sibling_busy(int cpu){
+  for(int x=cpus[cpu].lo[DOM_SMT];x<cpus[cpu].hi[DOM_SMT];x++)
+    if(x!=cpu && (cpus[x].curr || cpus[x].wakee || cpus[x].run_last==now))
+      return true;
+  return false;
+}
+
+// Run p on cpu for ms of the current tick, from start ms into it:
+//   2) Ensure the process has a non-zero quantum for its current level
+//   3) Account for the time (reduce work and print a log line)
+//   4) If finished, EXIT; otherwise re-enqueue (RR) and demote if slice expired
+// The tick's per-level and group counters and the replay decision go to the
+// process that holds the CPU at its end. Slices only count whole ticks: one
+// preempted by a mid-tick wakeup goes back to the tail of its level with its
+// slice intact, and the wakeup's rest of the tick is a bonus.
+static void run_part(int cpu, proc_t *p, int qid, int start, int ms){
+  bool holder = start+ms==TICK_MS;
+  cpu_t *c=&cpus[cpu];
+  // 2) Make sure there is a slice to run in
+  if(!p->ticks_left) p->ticks_left=nice_slice(p->nice,quantum[qid]);
+  int tier=nice_tier(p->nice);
+  long long t=now*TICK_MS+start;
+  if(p->first_run<0){
+    p->first_run=t;
+    hist_add(&stats.resp,(uint64_t)(t - p->arrive_ms));
+    hist_add(&stats.tier[tier].resp,(uint64_t)(t - p->arrive_ms));
+    hist_add(&groups[p->grp].resp,(uint64_t)(t - p->arrive_ms));
+    if(p->child) hist_add(&stats.fork.resp,(uint64_t)(t - p->arrive_ms));
+  }
+  if(p->woken_ms>=0){ hist_add(&stats.wake,(uint64_t)(t - p->woken_ms)); p->woken_ms=-1; }
+  if(holder){
+    stats.level_ticks[qid]++;
+    stats.tier[tier].ticks++;
+    if(dash_f) dash_tick(cpu,qid);
+    if(!start) p->ticks_left--;
+    c->run_pid=p->pid; c->run_last=now;
+  }
+
+  // 3) Run for ms
+  long long done=on_tick(cpu,p,topo.threads>1 && topo.smt_pct!=100 && sibling_busy(cpu),ms);
+  if(p->lock>=0) lock_progress(p,done);
+  if(holder && (rec_f || rpl_f)) decision(now, p->pid, p->level, 1);
+  if(ring) ring_put(RING_RUN, (uint32_t)p->pid, p->level, (uint32_t)ms);
+
+  // 4) Finished? Exit early.
+  PROF_BEGIN(PROF_ACCOUNT);
+  if(holder && ngroups>1) group_charge(cpu,p->grp);
+  int fam=-1;
+  if(p->fork_in>0 && (p->fork_in-=(int)done)<0) p->fork_in=0;
+  if(!p->fork_in && p->crit_left<=0){ p->fork_in=-1; fam=proc_fork(p,t+ms); }
+  if(p->work_left<=0){ PROF_ADD(PROF_ACCOUNT); proc_exit(p); return; }
+
+  // A parent that waits for its children, or a thread that reached its
+  // barrier (outside its critical section), blocks; an expired slice still
+  // demotes it first.
+  bool blocked=false;
+  if(p->tg>=0 && tgs[p->tg].barrier_ms) p->bar_left-=(int)done;
+  if(fam>=0){ fam_wait(p,fam,t+ms); blocked=true; }
+  else if(p->tg>=0 && tgs[p->tg].barrier_ms && p->bar_left<=0 && p->crit_left<=0) blocked=tg_barrier(p,t+ms);
+  if(blocked){
+    if(p->ticks_left<=0 && p->level<2) p->level++;
+    if(p->ticks_left<=0) p->ticks_left=nice_slice(p->nice,quantum[p->level]);
+    PROF_ADD(PROF_ACCOUNT);
+    return;
+  }
+
+  // A boosted lock owner keeps its inherited level until it releases.
+  if(p->boost>=0 && p->ticks_left<=0) p->ticks_left=nice_slice(p->nice,quantum[p->level]);
+
+  // Otherwise, perform RR and demotion as needed.
+  if(qid==0){ // L0
+    if(p->ticks_left>0){
+      // Still has slice: stay in L0, RR to tail
+      q_push(proc_q(p),p);
+    } else {
+      // Slice expired: demote to L1 with fresh L1 slice
+      if(qtrace){
+        if(trace) printf("Qv %d L0 L1\n", p->pid);
+        if(ring) ring_put(RING_DEMOTE, (uint32_t)p->pid, 0, 1);
+      }
+      p->level=1; p->ticks_left=nice_slice(p->nice,quantum[1]); q_push(proc_q(p),p);
+      PROF_COUNT(CNT_DEMOTE, 1);
+    }
+  } else if(qid==1){ // L1
+    if(p->ticks_left>0){
+      q_push(proc_q(p),p);
+    } else {
+      if(qtrace){
+        if(trace) printf("Qv %d L1 L2\n", p->pid);
+        if(ring) ring_put(RING_DEMOTE, (uint32_t)p->pid, 1, 2);
+      }
+      p->level=2; p->ticks_left=nice_slice(p->nice,quantum[2]);
+      if(cpu_misfit(cpu,p)) misfit_push(cpu,p); else q_push(proc_q(p),p);
+      PROF_COUNT(CNT_DEMOTE, 1);
+    }
+  } else { // L2
+    if(p->ticks_left>0){
+      // RR within L2
+      q_push(proc_q(p),p);
+    } else {
+      // L2 never demotes further; just refresh its L2 quantum
+      p->ticks_left=nice_slice(p->nice,quantum[2]); q_push(proc_q(p),p);
+    }
+  }
+  PROF_ADD(PROF_ACCOUNT);
+}
+
+
+static void trace_idle(int cpu, int ms){
+  if(!trace) return;
+  if(ncpus>1) printf("Process idle 0 has consumed %d ms in IDLE on cpu %d\n", ms, cpu);
+  else printf("Process idle 0 has consumed %d ms in IDLE\n", ms);
+}
+
+// Run exactly one tick of CPU time on what schedule_pick() chose (step 1).
+// A mid-tick wakee (wake_pending()) takes the CPU over at its offset.
+static void schedule_one_tick(int cpu){
+  cpu_t *c=&cpus[cpu];
+  int qid=c->curr_q, at=0;
+  proc_t *p=c->curr, *w=c->wakee;
+  c->curr=NULL; c->wakee=NULL;
+  if(!p && !w){
+    // No runnable process this tick (all done or waiting)
+    trace_idle(cpu,TICK_MS);
+    stats.idle_ticks++;
+    if(dash_f) dash_tick(cpu,-1);
+    return;
+  }
+  stats.busy_ticks++;
+  c->busy_ticks++;
+  if(pm.nopp) pm_busy(cpu, p ? p : w);
+  if(w){
+    at=c->wake_ms;
+    if(p) run_part(cpu,p,qid,0,at); else trace_idle(cpu,at);
+    p=w; qid=w->level;
+    c->run_from=now*TICK_MS+at;
+  }
+  run_part(cpu,p,qid,at,TICK_MS-at);
+}
+
+// True if no SMT sibling of cpu runs a process outside group grp this tick
+// (--core-sched).
+static bool core_fits(int cpu, int grp){
+  for(int x=cpus[cpu].lo[DOM_SMT];x<cpus[cpu].hi[DOM_SMT];x++)
+    if(x!=cpu && cpus[x].curr && cpus[x].curr->grp!=grp) return false;
+  return true;
+}
+
+static int wk_cmp(const void *a, const void *b){
+  const proc_t *p=*(proc_t *const *)a, *q=*(proc_t *const *)b;
+  if(p->arrive_ms!=q->arrive_ms) return p->arrive_ms<q->arrive_ms ? -1 : 1;
+  return p->pid<q->pid ? -1 : p->pid>q->pid;
+}
+
+// Mid-tick arrivals, in arrival order, once every CPU has picked. A wakee
+// takes its CPU from its arrival on if the CPU is idle or runs a process of
+// the same group at a lower level (under --wakeup granularity, not before
+// that process has run wakeup_gran_ms); at most one per CPU and tick.
+// Otherwise it is queued for the next tick. CPUs that were idle are added
+// to ran (NULL when every CPU runs anyway).
+static void wake_pending(int *ran, int *n){
+  qsort(wk.p,wk.len,sizeof *wk.p,wk_cmp);
+  for(int i=0;i<wk.len;i++){
+    proc_t *w=wk.p[i];
+    if(!place_proc(w) || !lock_acquire(w,w->arrive_ms)) continue;
+    cpu_t *c=&cpus[w->cpu];
+    long long at=w->arrive_ms;
+    bool ok = !c->wakee && !group_hidden(w->grp) && (!core_sched || core_fits(w->cpu,w->grp));
+    if(ok && c->curr){
+      ok = c->curr_q>w->level && c->curr->grp==w->grp;
+      if(ok && wakeup_mode==WAKE_GRAN && at<c->run_from+wakeup_gran_ms){
+        at=c->run_from+wakeup_gran_ms;
+        if(at>=(now+1)*TICK_MS){ stats.wake_held++; ok=false; }
+      }
+    }
+    if(!ok){ q_push(proc_q(w),w); continue; }
+    if(c->curr) stats.preempts++;
+    else if(ran) ran[(*n)++]=w->cpu;
+    c->wakee=w; c->wake_ms=(int)(at-now*TICK_MS);
+  }
+  wk.len=0;
+}
+
+// Lazy workload file (--workload). Lines are parsed until one of them creates
+// a job that arrives in the future; reading resumes at that job's arrival
+// tick. Only jobs that have arrived (plus one look-ahead) live in memory.
+static FILE *wl_f;
+static long long wl_pos;               // File offset, kept in snapshots
+static char *wl_line; static size_t wl_cap;
+
+static void wl_read(void){
+  if(!wl_f) return;
+  fseek(wl_f,wl_pos,SEEK_SET);
+  while(getline(&wl_line,&wl_cap,wl_f)>=0){
+    last_arrival=-1;
+    userinit_spin(wl_line);
+    wl_pos=ftell(wl_f);
+    if(last_arrival>now){ ev_push(last_arrival, EV_WORKLOAD, 0, NULL); return; }
+  }
+}
+
+// Fire every event that is due at the current tick.
+static void fire_due_events(void){
+  if(!evq_len || evq[0].tick>now) return;
+  PROF_BEGIN(PROF_EVENTS);
+  while(evq_len && evq[0].tick<=now){
+    event_t e=ev_pop();
+    switch(e.kind){
+    case EV_ARRIVAL: arrive(e.p); PROF_COUNT(CNT_ARRIVAL, 1); break;
+    case EV_GEN: {
+      gen_t *g=&gens[e.arg];
+      new_job("gen", (int)rng_range(1, 2LL*g->mean_ms), g->next_ms, g->nice, g->grp, g->aff, &g->js, true);
+      PROF_COUNT(CNT_ARRIVAL, 1);
+      if(--g->left>0){
+        g->next_ms += rng_range(0, 2LL*g->mean_gap_ms);
+        // Jobs already due arrive in this tick, so gaps shorter than a
+        // tick still give the intended arrival rate.
+        long long t=arrival_tick(g->next_ms);
+        ev_push(t>now ? t : now, EV_GEN, e.arg, NULL);
+      }
+      break;
+    }
+    case EV_WORKLOAD: wl_read(); break;
+    case EV_REFILL: group_refill(e.arg); break;
+    }
+  }
+  PROF_END(PROF_EVENTS);
+}
+
+// Processes queued on any CPU outside throttled subtrees.
+static bool any_runnable(void){ return nr_ready>0; }
+
+// Account n idle ticks at once and advance the clock past them. With the
+// periodic tick n is always 1; in tickless mode it covers the whole gap to
+// the next event, reported as a single IDLE line.
+static void idle_for(long long n){
+  PROF_BEGIN(PROF_TRACE);
+  if(trace) printf("Process idle 0 has consumed %lld ms in IDLE\n", n*TICK_MS);
+  PROF_END(PROF_TRACE);
+  PROF_COUNT(CNT_IDLE, n);
+  stats.idle_ticks += n*ncpus;
+  if(dash_f){
+    // Queues are empty while idle: only the idle counters move.
+    for(long long t=now, end=now+n; t<end; ){
+      dash_pt_t *d=dash_at(t);
+      long long k=(t/dash.width+1)*dash.width - t;
+      if(k>end-t) k=end-t;
+      d->idle+=k*ncpus; t+=k;
+    }
+  }
+  if(rec_f || rpl_f) decision(now, 0, REC_IDLE_LEVEL, n);
+  if(ring) ring_put(RING_IDLE, 0, 0, (uint32_t)(n>UINT32_MAX ? UINT32_MAX : n));
+  now += n;
+}
+
+// ---------------------------------------------------------------------------
+// Progress reporting (--progress / --progress-sec). The loop only compares
+// the clock against progress_next; wall-clock mode polls the real clock every
+// PROGRESS_POLL simulated ticks, so the cost is negligible either way.
+// ---------------------------------------------------------------------------
+
+#define PROGRESS_POLL 4096
+static FILE *progress_f;
+static long long progress_every;       // Simulated ticks between lines
+static double progress_sec;            // Or wall seconds between lines
+static long long progress_next, progress_last_tick;
+static double progress_last_wall;
+
+static double wall_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Resident set size in MB (from /proc on Linux; 0 where unavailable).
+static double rss_mb(void){
+  long pages=0, resident=0;
+  FILE *f=fopen("/proc/self/statm","r");
+  if(f){
+    if(fscanf(f,"%ld %ld",&pages,&resident)!=2) resident=0;
+    fclose(f);
+  }
+  return resident*(double)sysconf(_SC_PAGESIZE)/(1024.0*1024.0);
+}
+
+static void progress_report(double wall){
+  double dt=wall-progress_last_wall;
+  FILE *f = progress_f ? progress_f : stderr;
+  fprintf(f,"progress: t=%lld ms ticks/s=%.0f runnable L0=%d L1=%d L2=%d "
+          "done=%lld p99_resp=%llu ms rss=%.1f MB\n",
+          now*TICK_MS, dt>0 ? (now-progress_last_tick)/dt : 0.0,
+          level_len(0), level_len(1), level_len(2), stats.exited,
+          (unsigned long long)hist_quantile(&stats.resp,0.99), rss_mb());
+  fflush(f);
+  progress_last_tick=now; progress_last_wall=wall;
+}
+
+static void progress_check(void){
+  if(progress_every>0){
+    progress_report(wall_now());
+    progress_next=now+progress_every;
+  } else {
+    double wall=wall_now();
+    if(wall-progress_last_wall>=progress_sec) progress_report(wall);
+    progress_next=now+PROGRESS_POLL;
+  }
+}
+
+// One tick on every CPU: all pick, then all run. Idle CPUs only matter for
+// the trace, the dashboard, idle balancing and misfit pulls; otherwise only
+// CPUs with queued work are visited (all CPUs of a node with an overloaded
+// CPU, which may balance), found through the node and CPU busy bitmaps, and
+// the rest are counted idle in bulk.
+static void run_tick(void){
+  static int ran[MAX_CPUS];
+  if(ncpus==1 || trace || dash_f || (capacity_aware && topo.asym)){
+    for(int cpu=0;cpu<ncpus;cpu++) schedule_pick(cpu);
+    if(wk.len) wake_pending(NULL,NULL);
+    for(int cpu=0;cpu<ncpus;cpu++) schedule_one_tick(cpu);
+    return;
+  }
+  int n=0;
+  for(int w=0;w*64<nnodes;w++)
+    for(uint64_t m=node_busy[w];m;m&=m-1){
+      const node_t *nd=&nodes[w*64+__builtin_ctzll(m)];
+      for(int c = nd->overloaded ? nd->lo : bits_next(cpu_busy,ncpus,nd->lo-1);
+          c>=0 && c<nd->hi;
+          c = nd->overloaded ? c+1 : bits_next(cpu_busy,ncpus,c)){
+        schedule_pick(c);
+        if(cpus[c].curr) ran[n++]=c;
+      }
+    }
+  if(wk.len) wake_pending(ran,&n);
+  for(int i=0;i<n;i++) schedule_one_tick(ran[i]);
+  stats.idle_ticks+=ncpus-n;
+}
+
+// Main simulation loop, run until the clock reaches stop (or to the end when
+// stop<0). With the periodic tick, the simulation ends once nothing has been
+// runnable for more than ~10 ticks and no arrival is pending. In tickless
+// mode idle gaps are skipped and the loop ends exactly when the last event
+// has been processed. A hard cap on total ticks avoids accidental infinite
+// loops while experimenting.
+static void sim_run(long long stop){
+  PROF_BEGIN(PROF_RUN);
+  while(now<=max_ticks && (stop<0 || now<stop)){
+    if(progress_f && now>=progress_next) progress_check();
+    fire_due_events();
+    if(!any_runnable() && !wk.len){
+      if(tickless){
+        if(!evq_len) break; // all done
+        long long until = evq[0].tick;
+        if(until > max_ticks+1) until = max_ticks+1;
+        if(stop>=0 && until > stop) until = stop;
+        idle_for(until-now);
+        continue;
+      }
+      idle_streak++;
+      if(idle_streak>10 && !evq_len) break; // all done
+      idle_for(1);
+      continue;
+    }
+    idle_streak=0;
+    if(ncpus>1 && nr_overloaded) balance_tick();
+    run_tick();
+    if(nlocks) lock_tick();
+    now++;
+  }
+  PROF_END(PROF_RUN);
+}
+
+// ---------------------------------------------------------------------------
+// Checkpoint / restore
+//
+// A snapshot is a flat byte image of everything the simulation depends on:
+// clock, PRNG, counters, generators, the three run queues in order and the
+// pending event heap in heap order. Processes are stored by value and their
+// queue links are rebuilt on restore, so a restored run continues tick for
+// tick exactly like the original. That includes the run-mode flags (quanta,
+// --tickless, --pi, --wakeup, --core-sched, --capacity-aware, --governor):
+// a restored run uses the snapshot's. The image is tied to the build that wrote
+// it (struct sizes are checked), which keeps it compact and trivially fast
+// to load. Snapshots can live in memory (branching without fork()) or on disk.
+// ---------------------------------------------------------------------------
+
+#define SNAP_MAGIC "MLFQSNP1"
+
+typedef struct { unsigned char *data; size_t len, cap, pos; } snap_t;
+
+static void snap_put(snap_t *s, const void *v, size_t n){
+  if(s->len+n > s->cap){
+    while(s->len+n > s->cap) s->cap = s->cap ? s->cap*2 : 4096;
+    s->data = realloc(s->data, s->cap);
+    if(!s->data){ perror("realloc"); exit(1); }
+  }
+  memcpy(s->data+s->len, v, n);
+  s->len += n;
+}
+
+static bool snap_get(snap_t *s, void *v, size_t n){
+  if(s->pos+n > s->len) return false;
+  memcpy(v, s->data+s->pos, n);
+  s->pos += n;
+  return true;
+}
+
+static void snap_put_queue(snap_t *s, const queue_t *q){
+  long long n=0;
+  for(proc_t *p=q->head;p;p=p->next) n++;
+  snap_put(s,&n,sizeof n);
+  for(proc_t *p=q->head;p;p=p->next) snap_put(s,p,sizeof *p);
+}
+
+static proc_t* snap_get_proc(snap_t *s){
+  proc_t *p=malloc(sizeof *p);
+  if(!p || !snap_get(s,p,sizeof *p)){ free(p); return NULL; }
+  p->next=NULL;
+  return p;
+}
+
+// Rebuild a queue in stored order. Links are set directly so that restoring
+// does not show up as queue traffic in --qtrace output.
+static bool snap_get_queue(snap_t *s, queue_t *q){
+  long long n;
+  if(!snap_get(s,&n,sizeof n)) return false;
+  while(n-->0){
+    proc_t *p=snap_get_proc(s);
+    if(!p) return false;
+    if(!q->head) q->head=p; else q->tail->next=p;
+    q->tail=p; q->len++;
+  }
+  return true;
+}
+
+// Locks are stored by value with their waiters; owners are queued, and are
+// found again on restore as the processes inside a critical section.
+static void snap_put_locks(snap_t *s){
+  snap_put(s,&nlocks,sizeof nlocks);
+  snap_put(s,&nr_blocked,sizeof nr_blocked);
+  for(int i=0;i<nlocks;i++){
+    snap_put(s,&locks[i],sizeof locks[i]);
+    snap_put_queue(s,&locks[i].waiters);
+  }
+}
+
+static bool snap_get_locks(snap_t *s){
+  if(!snap_get(s,&nlocks,sizeof nlocks) || nlocks<0 || nlocks>MAX_LOCKS ||
+     !snap_get(s,&nr_blocked,sizeof nr_blocked)) return false;
+  for(int i=0;i<nlocks;i++){
+    if(!snap_get(s,&locks[i],sizeof locks[i])) return false;
+    locks[i].owner=NULL;
+    locks[i].waiters=(queue_t){0};
+    if(!snap_get_queue(s,&locks[i].waiters)) return false;
+  }
+  for(int c=0;c<ncpus && nlocks;c++)
+    for(int g=0;g<ngroups;g++)
+      for(int l=0;l<3;l++)
+        for(proc_t *p=cpu_q(c,g,l)->head;p;p=p->next)
+          if(p->lock>=0 && p->crit_left>0) locks[p->lock].owner=p;
+  return true;
+}
+
+// Thread groups are stored by value, free ones included, with the threads
+// waiting at each barrier.
+static void snap_put_tgroups(snap_t *s){
+  snap_put(s,&ntgs,sizeof ntgs);
+  snap_put(s,&tg_free,sizeof tg_free);
+  for(int i=0;i<ntgs;i++){
+    snap_put(s,&tgs[i],sizeof tgs[i]);
+    snap_put_queue(s,&tgs[i].waiters);
+  }
+}
+
+// Fork specs by value, then the families of waiting parents like thread
+// groups.
+static void snap_put_forks(snap_t *s){
+  snap_put(s,&nforks,sizeof nforks);
+  snap_put(s,forks,nforks*sizeof *forks);
+  snap_put(s,&nfams,sizeof nfams);
+  snap_put(s,&fam_free,sizeof fam_free);
+  for(int i=0;i<nfams;i++){
+    snap_put(s,&fams[i],sizeof fams[i]);
+    snap_put_queue(s,&fams[i].parent);
+  }
+}
+
+static bool snap_get_forks(snap_t *s){
+  int n;
+  if(!snap_get(s,&nforks,sizeof nforks) || nforks<0 || nforks>MAX_FORKS ||
+     !snap_get(s,forks,nforks*sizeof *forks) ||
+     !snap_get(s,&n,sizeof n) || n<0 || !snap_get(s,&fam_free,sizeof fam_free)) return false;
+  if(n>fams_cap){
+    fams=realloc(fams,n*sizeof *fams);
+    if(!fams){ perror("realloc"); exit(1); }
+    fams_cap=n;
+  }
+  nfams=n;
+  for(int i=0;i<nfams;i++){
+    if(!snap_get(s,&fams[i],sizeof fams[i])) return false;
+    fams[i].parent=(queue_t){0};
+    if(!snap_get_queue(s,&fams[i].parent)) return false;
+  }
+  return true;
+}
+
+static bool snap_get_tgroups(snap_t *s){
+  int n;
+  if(!snap_get(s,&n,sizeof n) || n<0 || !snap_get(s,&tg_free,sizeof tg_free)) return false;
+  if(n>tgs_cap){
+    tgs=realloc(tgs,n*sizeof *tgs);
+    if(!tgs){ perror("realloc"); exit(1); }
+    tgs_cap=n;
+  }
+  ntgs=n;
+  for(int i=0;i<ntgs;i++){
+    if(!snap_get(s,&tgs[i],sizeof tgs[i])) return false;
+    tgs[i].waiters=(queue_t){0};
+    if(!snap_get_queue(s,&tgs[i].waiters)) return false;
+  }
+  return true;
+}
+
+// Save the groups and CPUs: topology, group and per-CPU run-queue state
+// byte for byte (queue links are rebuilt on restore), then every CPU's
+// queues in order.
+static void snap_put_cpus(snap_t *s){
+  snap_put(s,&ngroups,sizeof ngroups);
+  snap_put(s,groups,ngroups*sizeof *groups);
+  snap_put(s,&ncpusets,sizeof ncpusets);
+  snap_put(s,cpusets,ncpusets*sizeof *cpusets);
+  snap_put(s,&ncpus,sizeof ncpus);
+  snap_put(s,&topo,sizeof topo);
+  snap_put(s,&pm,sizeof pm);
+  snap_put(s,runnable,sizeof runnable);
+  snap_put(s,&nr_ready,sizeof nr_ready);
+  snap_put(s,&nr_overloaded,sizeof nr_overloaded);
+  for(int c=0;c<ncpus;c++){
+    snap_put(s,&cpus[c],sizeof cpus[c]);
+    for(int g=0;g<ngroups;g++)
+      for(int l=0;l<3;l++) snap_put_queue(s,cpu_q(c,g,l));
+  }
+  snap_put(s,&nnodes,sizeof nnodes);
+  snap_put(s,nodes,nnodes*sizeof *nodes);
+  snap_put(s,node_busy,sizeof node_busy);
+  snap_put(s,cpu_busy,sizeof cpu_busy);
+  snap_put(s,&cl,sizeof cl);
+  snap_put(s,jiq,nnodes*sizeof *jiq);
+  snap_put(s,ll_heap,nnodes*sizeof *ll_heap);
+}
+
+static bool snap_get_cpus(snap_t *s){
+  int n;
+  if(!snap_get(s,&ngroups,sizeof ngroups) || ngroups<1 || ngroups>MAX_GROUPS ||
+     !snap_get(s,groups,ngroups*sizeof *groups) ||
+     !snap_get(s,&ncpusets,sizeof ncpusets) || ncpusets<1 || ncpusets>MAX_CPUSETS ||
+     !snap_get(s,cpusets,ncpusets*sizeof *cpusets) ||
+     !snap_get(s,&n,sizeof n) || n<1 || n>MAX_CPUS) return false;
+  if(n!=ncpus){
+    if(cpus!=&cpu0) free(cpus);
+    cpus = n==1 ? &cpu0 : malloc(n*sizeof *cpus);
+    if(!cpus){ perror("malloc"); exit(1); }
+    ncpus=n;
+  }
+  if(!snap_get(s,&topo,sizeof topo) ||
+     !snap_get(s,&pm,sizeof pm) ||
+     !snap_get(s,runnable,sizeof runnable) ||
+     !snap_get(s,&nr_ready,sizeof nr_ready) ||
+     !snap_get(s,&nr_overloaded,sizeof nr_overloaded)) return false;
+  for(int c=0;c<ncpus;c++){
+    if(!snap_get(s,&cpus[c],sizeof cpus[c])) return false;
+    for(int g=0;g<MAX_GROUPS;g++)
+      for(int l=0;l<3;l++) cpus[c].g[g].q[l]=(queue_t){0};
+    for(int g=0;g<ngroups;g++)
+      for(int l=0;l<3;l++) if(!snap_get_queue(s,cpu_q(c,g,l))) return false;
+  }
+  memset(group_on,0,sizeof group_on);
+  for(int c=0;c<ncpus;c++)
+    for(int g=0;g<ngroups;g++)
+      if(cpus[c].g[g].nr) group_on[g][c/64]|=1ULL<<(c%64);
+  return snap_get(s,&nnodes,sizeof nnodes) && nnodes>=1 && nnodes<=MAX_NODES &&
+         snap_get(s,nodes,nnodes*sizeof *nodes) &&
+         snap_get(s,node_busy,sizeof node_busy) &&
+         snap_get(s,cpu_busy,sizeof cpu_busy) &&
+         snap_get(s,&cl,sizeof cl) &&
+         snap_get(s,jiq,nnodes*sizeof *jiq) &&
+         snap_get(s,ll_heap,nnodes*sizeof *ll_heap);
+}
+
+// Drop every process and pending event, returning to an empty machine.
+static void sim_reset(void){
+  for(int c=0;c<ncpus;c++){
+    for(int g=0;g<ngroups;g++)
+      for(int i=0;i<3;i++)
+        for(proc_t *p=cpu_q(c,g,i)->head, *n; p; p=n){ n=p->next; free(p); }
+    cpu_init(&cpus[c]);
+  }
+  ngroups=1;
+  groups[0]=(group_t)GROUP_INIT("/",-1);
+  ncpusets=1;
+  cpusets[0]=(cpuset_t){ .spec="all" };
+  for(int i=0;i<nlocks;i++)
+    for(proc_t *p=locks[i].waiters.head, *n; p; p=n){ n=p->next; free(p); }
+  nlocks=0; nr_blocked=0;
+  for(int i=0;i<ntgs;i++)
+    for(proc_t *p=tgs[i].waiters.head, *n; p; p=n){ n=p->next; free(p); }
+  ntgs=0; tg_free=-1;
+  for(int i=0;i<nfams;i++) free(fams[i].parent.head);
+  nfams=0; fam_free=-1; nforks=0;
+  memset(runnable,0,sizeof runnable);
+  nr_ready=0; nr_overloaded=0;
+  wk.len=0;
+  memset(node_busy,0,sizeof node_busy);
+  memset(cpu_busy,0,sizeof cpu_busy);
+  memset(group_on,0,sizeof group_on);
+  cl.next_report=0; cl.jiq_head=cl.jiq_len=0; cl.jiq_misses=0;
+  for(int n=0;n<nnodes;n++){
+    node_t *nd=&nodes[n];
+    *nd=(node_t){ .lo=nd->lo, .hi=nd->hi };
+    if(nnodes>1) jiq_push(n);
+  }
+  memset(topo.migrations,0,sizeof topo.migrations);
+  topo.remote_ticks=topo.contended_ticks=topo.forced_idle=topo.misfits=0;
+  pm.busy_j=pm.idle_j=0; pm.mhz_ticks=0;
+  memset(pm.cs_ticks,0,sizeof pm.cs_ticks);
+  memset(pm.wakeups,0,sizeof pm.wakeups);
+  for(int i=0;i<evq_len;i++) free(evq[i].p);
+  evq_len=0; ev_seq=0; ngens=0; wl_pos=0;
+  now=0; idle_streak=0; next_pid=1;
+  memset(&stats,0,sizeof stats);
+}
+
+// The flags that change how a run proceeds, saved with every snapshot.
+typedef struct {
+  int quantum[3], wakeup_mode, wakeup_gran_ms, governor;
+  unsigned char tickless, lock_pi, core_sched, capacity_aware;
+} runmode_t;
+
+static runmode_t runmode_get(void){
+  return (runmode_t){ { quantum[0], quantum[1], quantum[2] }, wakeup_mode, wakeup_gran_ms, governor,
+                      tickless, lock_pi, core_sched, capacity_aware };
+}
+
+static void runmode_set(const runmode_t *m){
+  memcpy(quantum,m->quantum,sizeof quantum);
+  wakeup_mode=m->wakeup_mode; wakeup_gran_ms=m->wakeup_gran_ms; governor=m->governor;
+  tickless=m->tickless; lock_pi=m->lock_pi; core_sched=m->core_sched; capacity_aware=m->capacity_aware;
+}
+
+MAIN_ONLY static void sim_save(snap_t *s){
+  uint32_t hdr[3]={2, sizeof(proc_t), sizeof(stats)};
+  runmode_t mode=runmode_get();
+  s->len=s->pos=0;
+  snap_put(s,SNAP_MAGIC,8);
+  snap_put(s,hdr,sizeof hdr);
+  snap_put(s,&mode,sizeof mode);
+  snap_put(s,&now,sizeof now);
+  snap_put(s,&idle_streak,sizeof idle_streak);
+  snap_put(s,&next_pid,sizeof next_pid);
+  snap_put(s,&rng_state,sizeof rng_state);
+  snap_put(s,&ev_seq,sizeof ev_seq);
+  snap_put(s,&stats,sizeof stats);
+  snap_put(s,&wl_pos,sizeof wl_pos);
+  snap_put(s,&ngens,sizeof ngens);
+  snap_put(s,gens,ngens*sizeof *gens);
+  snap_put_cpus(s);
+  snap_put_locks(s);
+  snap_put_tgroups(s);
+  snap_put_forks(s);
+  unsigned char has_dash=dash_f!=NULL;
+  snap_put(s,&has_dash,1);
+  if(has_dash) snap_put(s,&dash,sizeof dash);
+  snap_put(s,&evq_len,sizeof evq_len);
+  for(int i=0;i<evq_len;i++){
+    unsigned char has=evq[i].p!=NULL;
+    snap_put(s,&evq[i],sizeof evq[i]);
+    snap_put(s,&has,1);
+    if(has) snap_put(s,evq[i].p,sizeof *evq[i].p);
+  }
+}
+
+MAIN_ONLY static bool sim_restore(snap_t *s){
+  char magic[8]; uint32_t hdr[3]; int n; runmode_t mode;
+  s->pos=0;
+  if(!snap_get(s,magic,8) || memcmp(magic,SNAP_MAGIC,8)) return false;
+  if(!snap_get(s,hdr,sizeof hdr) || hdr[0]!=2 ||
+     hdr[1]!=sizeof(proc_t) || hdr[2]!=sizeof(stats) ||
+     !snap_get(s,&mode,sizeof mode) || mode.wakeup_mode<0 || mode.wakeup_mode>=NWAKES ||
+     mode.governor<0 || mode.governor>=NGOVS) return false;
+  sim_reset();
+  runmode_set(&mode);
+  if(!snap_get(s,&now,sizeof now) ||
+     !snap_get(s,&idle_streak,sizeof idle_streak) ||
+     !snap_get(s,&next_pid,sizeof next_pid) ||
+     !snap_get(s,&rng_state,sizeof rng_state) ||
+     !snap_get(s,&ev_seq,sizeof ev_seq) ||
+     !snap_get(s,&stats,sizeof stats) ||
+     !snap_get(s,&wl_pos,sizeof wl_pos) ||
+     !snap_get(s,&ngens,sizeof ngens) || ngens<0 || ngens>MAX_GEN ||
+     !snap_get(s,gens,ngens*sizeof *gens) ||
+     !snap_get_cpus(s) || !snap_get_locks(s) ||
+     !snap_get_tgroups(s) || !snap_get_forks(s)) return false;
+  unsigned char has_dash;
+  if(!snap_get(s,&has_dash,1)) return false;
+  if(has_dash){
+    // Dashboard state is restored only if this run also collects it.
+    if(dash_f){ if(!snap_get(s,&dash,sizeof dash)) return false; }
+    else if((s->pos+=sizeof dash) > s->len) return false;
+  }
+  if(!snap_get(s,&n,sizeof n) || n<0) return false;
+  for(int i=0;i<n;i++){
+    event_t e; unsigned char has;
+    if(!snap_get(s,&e,sizeof e) || !snap_get(s,&has,1)) return false;
+    e.p = has ? snap_get_proc(s) : NULL;
+    if(has && !e.p) return false;
+    // Append in stored order: the array already satisfies the heap property.
+    if(evq_len==evq_cap){
+      evq_cap = evq_cap ? evq_cap*2 : 64;
+      evq = realloc(evq, evq_cap*sizeof(*evq));
+      if(!evq){ perror("realloc"); exit(1); }
+    }
+    evq[evq_len++]=e;
+  }
+  return true;
+}
+
+MAIN_ONLY static bool snap_write_file(const snap_t *s, const char *path){
+  FILE *f=fopen(path,"wb");
+  if(!f) return false;
+  bool ok = fwrite(s->data,1,s->len,f)==s->len;
+  return fclose(f)==0 && ok;
+}
+
+MAIN_ONLY static bool snap_read_file(snap_t *s, const char *path){
+  FILE *f=fopen(path,"rb");
+  if(!f) return false;
+  unsigned char buf[65536]; size_t n;
+  s->len=s->pos=0;
+  while((n=fread(buf,1,sizeof buf,f))>0) snap_put(s,buf,n);
+  bool ok=!ferror(f);
+  fclose(f);
+  return ok;
+}
+
+// Parse "A,B,C" into the three level quanta.
+MAIN_ONLY static bool parse_quanta(const char *s, int q[3]){
+  for(int i=0;i<3;i++){
+    const char *e=s;
+    q[i]=(int)parse_int(&e);
+    if(e==s || q[i]<=0 || (i<2 && *e!=',') || (i==2 && *e)) return false;
+    s=e+1;
+  }
+  return true;
+}
+
+// Topology summary, only with more than one CPU: per-CPU utilization spread,
+// migrations per domain level and time spent away from the home socket.
+static void print_cpu_stats(const char *label){
+  const char *lb = label ? label : "", *sp = label ? " " : "";
+  if(ncpus==1) return;
+  long long lo=cpus[0].busy_ticks, hi=lo;
+  for(int c=1;c<ncpus;c++){
+    if(cpus[c].busy_ticks<lo) lo=cpus[c].busy_ticks;
+    if(cpus[c].busy_ticks>hi) hi=cpus[c].busy_ticks;
+  }
+  long long per=(stats.busy_ticks+stats.idle_ticks)/ncpus;
+  fprintf(stderr,"%s%scpus: %d (%d sockets x %d cores x %d threads), busy per cpu %.1f%%..%.1f%%\n",
+          lb, sp, ncpus, topo.sockets, topo.cores, topo.threads,
+          per ? 100.0*lo/per : 0.0, per ? 100.0*hi/per : 0.0);
+  fprintf(stderr,"%s%smigrations:", lb, sp);
+  for(int d=0;d<NDOMS;d++) fprintf(stderr," %s %lld", dom_name[d], topo.migrations[d]);
+  fprintf(stderr,"; remote ticks %.1f%%", stats.busy_ticks ? 100.0*topo.remote_ticks/stats.busy_ticks : 0.0);
+  if(topo.threads>1)
+    fprintf(stderr,"; smt-contended ticks %.1f%%", stats.busy_ticks ? 100.0*topo.contended_ticks/stats.busy_ticks : 0.0);
+  if(core_sched) fprintf(stderr,"; forced idle %lld ticks", topo.forced_idle);
+  fprintf(stderr,"\n");
+  if(!topo.asym) return;
+  // Hybrid machines: how much each class of job gained or lost.
+  int cap_lo=topo.cap_max;
+  long long fast=0;
+  for(int c=0;c<ncpus;c++){
+    if(cpus[c].capacity<cap_lo) cap_lo=cpus[c].capacity;
+    if(cpu_fast(c)) fast+=cpus[c].busy_ticks;
+  }
+  fprintf(stderr,"%s%scapacity %d%%..%d%%, %.1f%% of busy ticks on fast cpus, %lld misfit migrations\n",
+          lb, sp, cap_lo, topo.cap_max, stats.busy_ticks ? 100.0*fast/stats.busy_ticks : 0.0, topo.misfits);
+  for(int l=0;l<3;l++){
+    if(!stats.cls[l].exited) continue;
+    fprintf(stderr,"%s%sclass L%d: %lld exited, response ms: p50 %llu p99 %llu; turnaround ms: p50 %llu p99 %llu\n",
+            lb, sp, l, stats.cls[l].exited,
+            (unsigned long long)hist_quantile(&stats.cls[l].resp,0.5),
+            (unsigned long long)hist_quantile(&stats.cls[l].resp,0.99),
+            (unsigned long long)hist_quantile(&stats.cls[l].turn,0.5),
+            (unsigned long long)hist_quantile(&stats.cls[l].turn,0.99));
+  }
+}
+
+// Cluster summary, only in cluster mode: spread of jobs and CPU use over
+// the nodes.
+static void print_cluster_stats(const char *label){
+  const char *lb = label ? label : "", *sp = label ? " " : "";
+  if(nnodes==1) return;
+  long long jlo=nodes[0].dispatched, jhi=jlo, blo=-1, bhi=0;
+  for(int n=0;n<nnodes;n++){
+    long long busy=0;
+    for(int c=nodes[n].lo;c<nodes[n].hi;c++) busy+=cpus[c].busy_ticks;
+    if(nodes[n].dispatched<jlo) jlo=nodes[n].dispatched;
+    if(nodes[n].dispatched>jhi) jhi=nodes[n].dispatched;
+    if(blo<0 || busy<blo) blo=busy;
+    if(busy>bhi) bhi=busy;
+  }
+  long long per=(stats.busy_ticks+stats.idle_ticks)/nnodes;
+  fprintf(stderr,"%s%scluster: %d nodes x %d cpus, dispatch %s, delay %lld ms, load reports every %lld ms; "
+          "jobs per node %lld..%lld, busy per node %.1f%%..%.1f%%",
+          lb, sp, nnodes, ncpus/nnodes, disp_name[cl.policy], cl.delay*TICK_MS, cl.period*TICK_MS,
+          jlo, jhi, per ? 100.0*blo/per : 0.0, per ? 100.0*bhi/per : 0.0);
+  if(cl.policy==DISP_JIQ) fprintf(stderr,"; no idle node for %lld jobs", cl.jiq_misses);
+  fprintf(stderr,"\n");
+}
+
+// Energy next to throughput and latency, only with the energy model on.
+static void print_energy_stats(const char *label){
+  const char *lb = label ? label : "", *sp = label ? " " : "";
+  if(!pm.nopp) return;
+  pm_settle();
+  double secs=(double)(stats.busy_ticks+stats.idle_ticks)/ncpus*TICK_MS/1000, joules=pm.busy_j+pm.idle_j;
+  fprintf(stderr,"%s%senergy: %.2f J (busy %.2f, idle %.2f), avg power %.2f W, %.1f jobs/s, %.3f J/job, "
+          "response p99 %llu ms; %s at avg %lld MHz\n", lb, sp, joules, pm.busy_j, pm.idle_j,
+          secs>0 ? joules/secs : 0.0, secs>0 ? stats.exited/secs : 0.0, stats.exited ? joules/stats.exited : 0.0,
+          (unsigned long long)hist_quantile(&stats.resp,0.99), gov_name[governor],
+          stats.busy_ticks ? pm.mhz_ticks/stats.busy_ticks : 0);
+  long long idle=0;
+  for(int i=0;i<pm.ncstates;i++) idle+=pm.cs_ticks[i];
+  if(!idle) return;
+  fprintf(stderr,"%s%sidle states:", lb, sp);
+  for(int i=0;i<pm.ncstates;i++)
+    fprintf(stderr,"%s %s %.1f%% (%lld wakeups)", i ? "," : "", pm.cs[i].name, 100.0*pm.cs_ticks[i]/idle, pm.wakeups[i]);
+  fprintf(stderr,"\n");
+}
+
+// Per-group breakdown, only when groups were defined. CPU share covers the
+// group's whole subtree; latencies cover its own processes.
+static void print_group_stats(const char *label){
+  const char *lb = label ? label : "", *sp = label ? " " : "";
+  if(ngroups==1) return;
+  for(int g=0;g<ngroups;g++){
+    const group_t *gr=&groups[g];
+    char quota[96]="";
+    if(gr->quota_ms && g){
+      long long thr=gr->throttled_ticks + (gr->throttled ? now-gr->throttled_since : 0);
+      snprintf(quota,sizeof quota," quota %d/%d ms, throttled in %lld of %lld periods for %lld ms",
+               gr->quota_ms, gr->period_ms, gr->throttles, gr->periods, thr*TICK_MS);
+    }
+    fprintf(stderr,"%s%sgroup %s weight %d%s: cpu %.1f%%, %lld exited, "
+            "response ms: p50 %llu p99 %llu; turnaround ms: p50 %llu p99 %llu\n",
+            lb, sp, gr->path, gr->weight, quota,
+            stats.busy_ticks ? 100.0*gr->ticks/stats.busy_ticks : 0.0, gr->exited,
+            (unsigned long long)hist_quantile(&gr->resp,0.5), (unsigned long long)hist_quantile(&gr->resp,0.99),
+            (unsigned long long)hist_quantile(&gr->turn,0.5), (unsigned long long)hist_quantile(&gr->turn,0.99));
+  }
+}
+
+// Per-affinity-set latencies, only when some job was pinned.
+static void print_cpuset_stats(const char *label){
+  const char *lb = label ? label : "", *sp = label ? " " : "";
+  if(ncpusets==1) return;
+  for(int a=0;a<ncpusets;a++){
+    const cpuset_t *cs=&cpusets[a];
+    fprintf(stderr,"%s%scpus=%s: %lld exited, response ms: p50 %llu p99 %llu; turnaround ms: p50 %llu p99 %llu\n",
+            lb, sp, cs->spec, cs->exited,
+            (unsigned long long)hist_quantile(&cs->resp,0.5), (unsigned long long)hist_quantile(&cs->resp,0.99),
+            (unsigned long long)hist_quantile(&cs->turn,0.5), (unsigned long long)hist_quantile(&cs->turn,0.99));
+  }
+}
+
+// Per-lock contention, only when the workload uses locks.
+static void print_lock_stats(const char *label){
+  const char *lb = label ? label : "", *sp = label ? " " : "";
+  for(int i=0;i<nlocks;i++){
+    const lock_t *l=&locks[i];
+    long long eps=l->inv_eps+(l->inv_cur>0), longest=l->inv_cur>l->inv_max ? l->inv_cur : l->inv_max;
+    fprintf(stderr,"%s%slock %s: %lld acquisitions, %.1f%% contended, wait ms: p50 %llu p99 %llu; "
+            "inverted %lld ms in %lld episodes (longest %lld ms)",
+            lb, sp, l->name, l->acquired, l->acquired ? 100.0*l->contended/l->acquired : 0.0,
+            (unsigned long long)hist_quantile(&l->wait,0.5), (unsigned long long)hist_quantile(&l->wait,0.99),
+            l->inv_ticks*TICK_MS, eps, longest*TICK_MS);
+    if(lock_pi) fprintf(stderr,", %lld PI boosts",l->boosts);
+    fprintf(stderr,"\n");
+  }
+}
+
+static void print_thread_stats(const char *label){
+  if(!ntgs) return;
+  const char *lb = label ? label : "", *sp = label ? " " : "";
+  fprintf(stderr,"%s%sthreads: %lld jobs done, job turnaround ms: p50 %llu p99 %llu; %lld barriers, "
+          "straggler gap ms: p50 %llu p99 %llu; %.1f%% of thread time waiting at barriers\n",
+          lb, sp, stats.thr.jobs,
+          (unsigned long long)hist_quantile(&stats.thr.turn,0.5), (unsigned long long)hist_quantile(&stats.thr.turn,0.99),
+          stats.thr.barriers,
+          (unsigned long long)hist_quantile(&stats.thr.gap,0.5), (unsigned long long)hist_quantile(&stats.thr.gap,0.99),
+          stats.thr.life_ms ? 100.0*stats.thr.wait_ms/stats.thr.life_ms : 0.0);
+}
+
+static void print_fork_stats(const char *label){
+  if(!nforks) return;
+  const char *lb = label ? label : "", *sp = label ? " " : "";
+  fprintf(stderr,"%s%sforks: %lld forks, %lld children, child response ms: p50 %llu p99 %llu, "
+          "turnaround ms: p50 %llu p99 %llu; %llu parent waits, ms: p50 %llu p99 %llu\n",
+          lb, sp, stats.fork.forks, stats.fork.children,
+          (unsigned long long)hist_quantile(&stats.fork.resp,0.5), (unsigned long long)hist_quantile(&stats.fork.resp,0.99),
+          (unsigned long long)hist_quantile(&stats.fork.turn,0.5), (unsigned long long)hist_quantile(&stats.fork.turn,0.99),
+          (unsigned long long)stats.fork.wait.count,
+          (unsigned long long)hist_quantile(&stats.fork.wait,0.5), (unsigned long long)hist_quantile(&stats.fork.wait,0.99));
+}
+
+MAIN_ONLY static void print_stats(const char *label){
+  long long total=stats.busy_ticks+stats.idle_ticks;
+  const char *lb = label ? label : "", *sp = label ? " " : "";
+  fprintf(stderr,"%s%sticks: %lld busy, %lld idle (%.1f%% utilization), %lld exited\n",
+          lb, sp, stats.busy_ticks, stats.idle_ticks,
+          total ? 100.0*stats.busy_ticks/total : 0.0, stats.exited);
+  fprintf(stderr,"%s%sresponse ms: p50 %llu p99 %llu; turnaround ms: p50 %llu p99 %llu\n", lb, sp,
+          (unsigned long long)hist_quantile(&stats.resp,0.5), (unsigned long long)hist_quantile(&stats.resp,0.99),
+          (unsigned long long)hist_quantile(&stats.turn,0.5), (unsigned long long)hist_quantile(&stats.turn,0.99));
+  fprintf(stderr,"%s%swakeup latency ms (%s): p50 %llu p99 %llu p99.9 %llu; %lld mid-tick preemptions",
+          lb, sp, wake_name[wakeup_mode],
+          (unsigned long long)hist_quantile(&stats.wake,0.5), (unsigned long long)hist_quantile(&stats.wake,0.99),
+          (unsigned long long)hist_quantile(&stats.wake,0.999), stats.preempts);
+  if(wakeup_mode==WAKE_GRAN) fprintf(stderr,", %lld held to the next tick by the %d ms granularity",
+                                     stats.wake_held, wakeup_gran_ms);
+  fprintf(stderr,"\n");
+  print_cpu_stats(label);
+  print_cluster_stats(label);
+  print_energy_stats(label);
+  print_group_stats(label);
+  print_cpuset_stats(label);
+  print_lock_stats(label);
+  print_thread_stats(label);
+  print_fork_stats(label);
+  // Per-tier breakdown, only when the workload mixes nice values.
+  int used=0;
+  for(int t=0;t<NTIERS;t++) used += stats.tier[t].ticks>0 || stats.tier[t].exited>0;
+  if(used<2) return;
+  static const char *tier_name[NTIERS]={"nice<0","nice=0","nice>0"};
+  for(int t=0;t<NTIERS;t++){
+    if(!stats.tier[t].ticks && !stats.tier[t].exited) continue;
+    fprintf(stderr,"%s%stier %-6s cpu %.1f%%, %lld exited, response ms: p50 %llu p99 %llu; "
+            "turnaround ms: p50 %llu p99 %llu\n", lb, sp, tier_name[t],
+            stats.busy_ticks ? 100.0*stats.tier[t].ticks/stats.busy_ticks : 0.0, stats.tier[t].exited,
+            (unsigned long long)hist_quantile(&stats.tier[t].resp,0.5),
+            (unsigned long long)hist_quantile(&stats.tier[t].resp,0.99),
+            (unsigned long long)hist_quantile(&stats.tier[t].turn,0.5),
+            (unsigned long long)hist_quantile(&stats.tier[t].turn,0.99));
+  }
+}
+
+#ifdef MLFQ_PROF
+// Cycle breakdown of the instrumented sections. "run" is the whole main loop.
+// "events" includes allocating jobs created by generators, which also shows
+// up under "alloc"; the other sections do not overlap.
+static void prof_report(void){
+  static const char *sect[PROF_NSECT]={"parse","pick","account","alloc","trace","events","run"};
+  static const char *cnt[CNT_NCNT]={"arrivals","enqueues","dequeues","demotions","exits","idle_ticks"};
+  uint64_t run=prof_cycles[PROF_RUN];
+  fprintf(stderr,"prof: %-8s %12s %16s %10s %7s\n","section","calls","cycles","cyc/call","%run");
+  for(int i=0;i<PROF_NSECT;i++)
+    fprintf(stderr,"prof: %-8s %12llu %16llu %10.1f %6.1f%%\n", sect[i],
+            (unsigned long long)prof_calls[i], (unsigned long long)prof_cycles[i],
+            prof_calls[i] ? (double)prof_cycles[i]/prof_calls[i] : 0.0,
+            run ? 100.0*prof_cycles[i]/run : 0.0);
+  for(int i=0;i<CNT_NCNT;i++)
+    fprintf(stderr,"prof: %-10s %llu\n", cnt[i], (unsigned long long)prof_cnt[i]);
+}
+#endif
+
+#ifndef MLFQSIM_NO_MAIN
+int main(int argc, char **argv){
+  // Options come first; the remaining argument is a mini command list, e.g.:
+  //   "spin 10000 &; spin 200000 &; spin 3000000 &;"
+  const char *cmdline = "spin 10000 &; spin 200000 &; spin 3000000 &;";
+  const char *ckpt_path=NULL, *restore_path=NULL;
+  long long ckpt_at=-1, branch_at=-1;
+  int branch_q[3]={Q_L0,Q_L1,Q_L2};
+  bool energy=false;
+  int nnodes_opt=1;
+  for(int i=1;i<argc;i++){
+    const char *a=argv[i];
+    if(!strcmp(a,"--tickless")) tickless=true;
+    else if(!strcmp(a,"--stats")) show_stats=true;
+    else if(!strcmp(a,"--quiet")) trace=false;
+    else if(!strcmp(a,"--qtrace")) qtrace=true;
+    else if(!strcmp(a,"--workload") && i+1<argc){
+      if(!(wl_f=fopen(argv[++i],"r"))){ perror(argv[i]); return 1; }
+    }
+    else if(!strcmp(a,"--progress") && i+1<argc){ progress_every=atoll(argv[++i]); if(!progress_f) progress_f=stderr; }
+    else if(!strcmp(a,"--progress-sec") && i+1<argc){ progress_sec=atof(argv[++i]); if(!progress_f) progress_f=stderr; }
+    else if(!strcmp(a,"--progress-out") && i+1<argc){
+      if(!(progress_f=fopen(argv[++i],"w"))){ perror(argv[i]); return 1; }
+    }
+    else if(!strcmp(a,"--shm") && i+1<argc){
+      if(!ring_open(argv[++i])){ perror("shm"); return 1; }
+    }
+    else if(!strcmp(a,"--stats-out") && i+1<argc){
+      if(!(dash_f=fopen(argv[++i],"w"))){ perror(argv[i]); return 1; }
+    }
+    else if(!strcmp(a,"--max-ticks") && i+1<argc) max_ticks=atoll(argv[++i]);
+    else if(!strcmp(a,"--cpus") && i+1<argc){
+      int n=atoi(argv[++i]);
+      topo_regular(1, n>0 ? n : 1, 1, 0);
+    }
+    else if(!strcmp(a,"--nodes") && i+1<argc) nnodes_opt=atoi(argv[++i]);
+    else if(!strcmp(a,"--dispatch") && i+1<argc){
+      const char *d=argv[++i];
+      for(cl.policy=0;cl.policy<NDISPS && strcmp(d,disp_name[cl.policy]);cl.policy++);
+      if(cl.policy==NDISPS){ fprintf(stderr,"mlfqsim: unknown dispatch policy %s\n",d); return 2; }
+    }
+    else if(!strcmp(a,"--dispatch-delay") && i+1<argc) cl.delay=(atoll(argv[++i])+TICK_MS-1)/TICK_MS;
+    else if(!strcmp(a,"--load-period") && i+1<argc){
+      cl.period=(atoll(argv[++i])+TICK_MS-1)/TICK_MS;
+      if(cl.period<1) cl.period=1;
+    }
+    else if(!strcmp(a,"--core-sched")) core_sched=true;
+    else if(!strcmp(a,"--capacity-aware")) capacity_aware=true;
+    else if(!strcmp(a,"--pi")) lock_pi=true;
+    else if(!strcmp(a,"--wakeup") && i+1<argc){
+      const char *w=argv[++i];
+      for(wakeup_mode=0;wakeup_mode<NWAKES && strcmp(w,wake_name[wakeup_mode]);wakeup_mode++);
+      if(wakeup_mode==NWAKES){ fprintf(stderr,"mlfqsim: unknown wakeup mode %s\n",w); return 2; }
+    }
+    else if(!strcmp(a,"--wakeup-gran") && i+1<argc){ wakeup_gran_ms=atoi(argv[++i]); wakeup_mode=WAKE_GRAN; }
+    else if(!strcmp(a,"--governor") && i+1<argc){
+      const char *g=argv[++i];
+      for(governor=0;governor<NGOVS && strcmp(g,gov_name[governor]);governor++);
+      if(governor==NGOVS){ fprintf(stderr,"mlfqsim: unknown governor %s\n",g); return 2; }
+      energy=true;
+    }
+    else if(!strcmp(a,"--topology") && i+1<argc){
+      if(!topo_load(argv[++i])){ fprintf(stderr,"cannot load topology %s\n",argv[i]); return 1; }
+    }
+    else if(!strcmp(a,"--seed") && i+1<argc) rng_state=strtoull(argv[++i],NULL,0)|1;
+    else if(!strcmp(a,"--checkpoint-at") && i+2<argc){ ckpt_at=atoll(argv[++i]); ckpt_path=argv[++i]; }
+    else if(!strcmp(a,"--restore") && i+1<argc) restore_path=argv[++i];
+    else if(!strcmp(a,"--branch-at") && i+1<argc) branch_at=atoll(argv[++i]);
+    else if(!strcmp(a,"--record") && i+1<argc){
+      if(!(rec_f=fopen(argv[++i],"wb"))){ perror(argv[i]); return 1; }
+      fwrite(REC_MAGIC,1,8,rec_f);
+    }
+    else if(!strcmp(a,"--replay") && i+1<argc){
+      char magic[8];
+      if(!(rpl_f=fopen(argv[++i],"rb"))){ perror(argv[i]); return 1; }
+      if(fread(magic,1,8,rpl_f)!=8 || memcmp(magic,REC_MAGIC,8)){
+        fprintf(stderr,"mlfqsim: %s is not a decision recording\n",argv[i]); return 1;
+      }
+    }
+    else if(!strcmp(a,"--quanta") && i+1<argc){
+      if(!parse_quanta(argv[++i],quantum)){ fprintf(stderr,"mlfqsim: bad --quanta\n"); return 2; }
+    }
+    else if(!strcmp(a,"--branch-quanta") && i+1<argc){
+      if(!parse_quanta(argv[++i],branch_q)){ fprintf(stderr,"mlfqsim: bad --branch-quanta\n"); return 2; }
+    }
+    else if(!strncmp(a,"--",2)){ fprintf(stderr,"mlfqsim: unknown option %s\n",a); return 2; }
+    else cmdline=a;
+  }
+  if(energy || pm.nopp) pm_defaults();
+  if(nnodes_opt>1) topo_nodes(nnodes_opt);
+
+  snap_t snap={0};
+  if(restore_path){
+    runmode_t asked=runmode_get(), used;
+    if(!snap_read_file(&snap,restore_path) || !sim_restore(&snap)){
+      fprintf(stderr,"mlfqsim: cannot restore snapshot %s\n",restore_path);
+      return 1;
+    }
+    used=runmode_get();
+    if(memcmp(&asked,&used,sizeof used))
+      fprintf(stderr,"mlfqsim: %s was saved with other run-mode flags (quanta, --tickless, --pi, --wakeup, "
+              "--core-sched, --capacity-aware, --governor); continuing with the snapshot's\n",restore_path);
+  } else {
+    PROF_BEGIN(PROF_PARSE);
+    if(wl_f) wl_read();
+    else userinit_spin(cmdline);
+    PROF_END(PROF_PARSE);
+  }
+  if(progress_f){
+    if(progress_every<=0 && progress_sec<=0) progress_sec=1.0;
+    progress_last_wall=wall_now(); progress_last_tick=now; progress_next=now;
+  }
+
+  if(ckpt_at>=0){
+    sim_run(ckpt_at);
+    sim_save(&snap);
+    if(!snap_write_file(&snap,ckpt_path)){
+      fprintf(stderr,"mlfqsim: cannot write snapshot %s\n",ckpt_path);
+      return 1;
+    }
+  }
+
+  if(branch_at>=0){
+    snap_t clone={0};
+    sim_run(branch_at);
+    sim_save(&clone);
+    sim_run(-1);
+    print_stats("[baseline]");
+    if(!sim_restore(&clone)){
+      fprintf(stderr,"mlfqsim: cannot rewind to the branch point\n");
+      return 1;
+    }
+    memcpy(quantum,branch_q,sizeof quantum);
+    sim_run(-1);
+    print_stats("[branch]");
+    free(clone.data);
+  } else {
+    sim_run(-1);
+    if(show_stats) print_stats(NULL);
   }
+  if(dash_f){ dash_write(dash_f); fclose(dash_f); }
+  if(ring) ring_close();
+  if(progress_f){ progress_report(wall_now()); if(progress_f!=stderr) fclose(progress_f); }
+  if(wl_f){ fclose(wl_f); free(wl_line); }
+  if(rec_f){ rec_flush(); fclose(rec_f); }
+  if(rpl_f){ rpl_report(); fclose(rpl_f); }
+#ifdef MLFQ_PROF
+  prof_report();
+#endif
+  free(snap.data);
   return 0;
 }
+#endif // MLFQSIM_NO_MAIN
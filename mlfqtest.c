@@ -0,0 +1,83 @@
+/*
+ * Unit checks for the MLFQ simulator
+ * ----------------------------------
+ * Builds mlfqsim.c in-place (without its main), like mlfqbench.c, and
+ * checks helpers whose output is easy to get subtly wrong:
+ *
+ *   - hist_quantile: nearest-rank quantiles, including a p99 carried by
+ *     the top ~1% of a small sample
+ *   - a short run of the whole engine: tick totals and the p99 response
+ *     time it reports
+ *
+ * Prints one line per failed check and exits non-zero if any failed:
+ *
+ *   make test
+ */
+
+#define MLFQSIM_NO_MAIN
+#include "mlfqsim.c"
+
+static int failed;
+
+static void check_u64(const char *what, uint64_t got, uint64_t want){
+  if(got==want) return;
+  printf("FAIL %s: got %llu, want %llu\n", what, (unsigned long long)got, (unsigned long long)want);
+  failed++;
+}
+
+// Histogram of zero samples followed by tail samples of value v.
+static void hist_fill(hist_t *h, int zero, int tail, uint64_t v){
+  memset(h,0,sizeof *h);
+  for(int i=0;i<zero;i++) hist_add(h,0);
+  for(int i=0;i<tail;i++) hist_add(h,v);
+}
+
+static void test_hist_quantile(void){
+  static hist_t h;
+  uint64_t top=hist_lower(hist_bucket(500));
+
+  memset(&h,0,sizeof h);
+  check_u64("empty p99", hist_quantile(&h,0.99), 0);
+
+  // 2 of 199 samples (just over 1%) are 500: the 198th smallest is one.
+  hist_fill(&h,197,2,500);
+  check_u64("p99 of 197x0 + 2x500", hist_quantile(&h,0.99), top);
+  check_u64("p50 of 197x0 + 2x500", hist_quantile(&h,0.5), 0);
+
+  // 1 of 50: p99 is the 50th smallest, i.e. the maximum.
+  hist_fill(&h,49,1,500);
+  check_u64("p99 of 49x0 + 1x500", hist_quantile(&h,0.99), top);
+
+  // Exactly 1% of 1000: the 990th smallest is still 0, p99.9 is not.
+  hist_fill(&h,990,10,500);
+  check_u64("p99 of 990x0 + 10x500", hist_quantile(&h,0.99), 0);
+  check_u64("p99.9 of 990x0 + 10x500", hist_quantile(&h,0.999), top);
+
+  // 1..10 lands in exact buckets: p50 is the 5th, p0 the 1st, p100 the 10th.
+  memset(&h,0,sizeof h);
+  for(uint64_t v=1;v<=10;v++) hist_add(&h,v);
+  check_u64("p50 of 1..10", hist_quantile(&h,0.5), 5);
+  check_u64("p0 of 1..10", hist_quantile(&h,0), 1);
+  check_u64("p100 of 1..10", hist_quantile(&h,1), 10);
+}
+
+// Two spins on one CPU: the second first runs after the first's 10 ms slice,
+// so of the two response times (0 and 10 ms) p99 is 10.
+static void test_engine(void){
+  sim_reset();
+  trace=false; tickless=true;
+  userinit_spin("spin 50 &; spin 30 &;");
+  sim_run(-1);
+  check_u64("busy ticks", (uint64_t)stats.busy_ticks, 8);
+  check_u64("exited", (uint64_t)stats.exited, 2);
+  check_u64("response p99", hist_quantile(&stats.resp,0.99), 10);
+  sim_reset();
+  trace=true; tickless=false;
+}
+
+int main(void){
+  test_hist_quantile();
+  test_engine();
+  if(!failed) printf("mlfqtest: all checks passed\n");
+  return failed!=0;
+}
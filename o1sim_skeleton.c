@@ -2,6 +2,17 @@
 // Build: gcc -O2 -Wall -Wextra -o o1sim_skeleton o1sim_skeleton.c
 // Run:   ./o1sim_skeleton "spin 10000 &; spin 200000 &; spin 3000000 &;"
 // Output lines are parsed by o1viz.py. Keep the format stable.
+//
+// A job may carry a nice value ("spin 500 nice=10", -20..19) or a static
+// priority ("prio=130", i.e. 120+nice). Nice scales the AQ/EQ timeslice like
+// the real O(1) scheduler and chooses the starting queue (see below).
+//
+// Run with --qtrace as the first argument to also log queue operations, so
+// tools can rebuild exact queue contents without re-implementing the policy:
+//   Q+ <pid> <queue>        enqueue at tail
+//   Q- <pid> <queue>        dequeue from head
+//   Qv <pid> <from> <to>    demotion (AQ -> EQ), logged before the Q+
+//   Q~ AQ EQ                AQ and EQ swapped contents
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,6 +34,7 @@ struct proc {
   char name[32];
   int work_left;     // total ms of CPU work left
   int ticks_left;    // ticks left in current time slice
+  int nice;          // -20..19; see nice_slice() and nice_queue()
   const char *in_queue; // "FQ" | "AQ" | "EQ" | NULL
   proc_t *next;
 };
@@ -31,27 +43,56 @@ typedef struct { proc_t *head, *tail; } queue_t;
 
 static queue_t FQ={0}, AQ={0}, EQ={0};
 static int next_pid=1;
+static bool qtrace=false;
+
+// Queue names come from the queue's identity (not a field), so they stay
+// correct after maybe_swap_queues() exchanges AQ and EQ's contents.
+static const char *qname(const queue_t *q) {
+  return q==&FQ ? "FQ" : q==&AQ ? "AQ" : "EQ";
+}
+
+// O(1) timeslices: static priority 120+nice gets (140-prio)*20ms below 120
+// and (140-prio)*5ms from 120 on (100ms at nice 0). Scale a base quantum by
+// the same ratio relative to nice 0, in whole ticks and never below one.
+// Use this whenever a slice is refilled, e.g. p->ticks_left = nice_slice(p->nice, AQ_Q).
+static int nice_slice(int nice, int base) {
+  int prio = 120 + nice;
+  int scale = prio < 120 ? (140 - prio) * 4 : 140 - prio;  // nice 0 -> 20
+  int t = (base * scale + 10) / 20;
+  return t > 0 ? t : 1;
+}
+
+// Starting queue: nice <= 0 gets the FQ boost, 1..9 starts in AQ and batch
+// jobs (nice 10..19) go straight to EQ.
+static queue_t *nice_queue(int nice) {
+  return nice <= 0 ? &FQ : nice < 10 ? &AQ : &EQ;
+}
 
 // Queue helpers (students fill these two)
 static void q_push(queue_t *q, proc_t *p) {
+  if (qtrace) printf("Q+ %d %s\n", p->pid, qname(q));
   // TODO: enqueue p at tail in O(1)
   // Hints: if queue empty, head=tail=p; else tail->next=p; tail=p; p->next=NULL
 }
 
 static proc_t* q_pop(queue_t *q) {
+  proc_t *p = NULL;
   // TODO: pop from head in O(1)
   // Hints: remove head; if becomes empty set tail=NULL; return removed proc
-  return NULL;
+  if (p && qtrace) printf("Q- %d %s\n", p->pid, qname(q));
+  return p;
 }
 
-static proc_t* new_proc(const char *name, int work_ms) {
+static proc_t* new_proc(const char *name, int work_ms, int nice) {
   proc_t *p = (proc_t*)calloc(1, sizeof(proc_t));
+  queue_t *q = nice_queue(nice);
   p->pid = next_pid++;
   snprintf(p->name, sizeof(p->name), "%s", name);
   p->work_left = work_ms;
-  p->ticks_left = FQ_Q; // start in FQ
-  p->in_queue = "FQ";
-  q_push(&FQ, p);
+  p->nice = nice;
+  p->ticks_left = nice_slice(nice, q==&FQ ? FQ_Q : q==&AQ ? AQ_Q : EQ_Q);
+  p->in_queue = qname(q);
+  q_push(q, p);
   return p;
 }
 
@@ -75,7 +116,17 @@ static void userinit_spin(const char *cmd) {
       // Parse decimal integer for work in ms
       int ms = 0;
       while(*s>='0'&&*s<='9') { ms = ms*10 + (*s-'0'); s++; }
-      if(ms>0) new_proc("spin", ms);
+      // Optional nice=N / prio=P before the next separator
+      int nice = 0;
+      while(*s && *s!=';'){
+        while(*s==' '||*s=='\t'||*s=='&') s++;
+        if(strncmp(s,"nice=",5)==0) nice = atoi(s+5);
+        else if(strncmp(s,"prio=",5)==0) nice = atoi(s+5) - 120;
+        while(*s && *s!=';' && *s!=' ' && *s!='\t') s++;
+      }
+      if(nice < -20) nice = -20;
+      if(nice > 19) nice = 19;
+      if(ms>0) new_proc("spin", ms, nice);
     }
 
     // Skip to next separator
@@ -92,6 +143,7 @@ static void proc_exit(proc_t *p) {
 static void maybe_swap_queues(void) {
   // TODO: O(1) trick: if AQ empty and EQ non-empty, swap their identities
   // Hints: swap the queue_t structs (head/tail) so next picks come from old EQ
+  // After swapping, log it for --qtrace: if (qtrace) printf("Q~ AQ EQ\n");
 }
 
 static void on_tick_run(const char *qname, proc_t *p) {
@@ -104,13 +156,16 @@ static void schedule_one_tick(void) {
   // TODO: choose a process to run for one tick, and manage queue transitions.
   // Policy:
   // 1) Always prefer FQ, else AQ, else EQ (after maybe_swap_queues()).
-  // 2) When a process runs 1 tick in FQ, move it to AQ with ticks_left=AQ_Q.
-  // 3) In AQ, round-robin with quantum AQ_Q. On expiry, demote to EQ.
-  // 4) In EQ, round-robin with quantum EQ_Q (no lower level).
+  // 2) When a process runs 1 tick in FQ, move it to AQ with
+  //    ticks_left=nice_slice(p->nice, AQ_Q).
+  // 3) In AQ, round-robin with the nice-scaled AQ_Q. On expiry, demote to EQ
+  //    (with --qtrace, log "Qv <pid> AQ EQ" before pushing to EQ).
+  // 4) In EQ, round-robin with the nice-scaled EQ_Q (no lower level).
   // 5) If work_left <= 0, EXIT and do not requeue.
 }
 
 int main(int argc, char **argv) {
+  if (argc>=2 && strcmp(argv[1], "--qtrace")==0) { qtrace = true; argv++; argc--; }
   const char *cmdline = (argc>=2)? argv[1] : "spin 10000 &; spin 200000 &; spin 3000000 &;";
   userinit_spin(cmdline);
 
@@ -2,7 +2,8 @@
 # Copied from o1-scheduler-sim/o1viz.py (supports --mode o1|mlfq)
 # Minimal dependencies: matplotlib, pillow (for GIF). Optional: numpy<2.
 
-import argparse, json, os, re, subprocess, sys
+import argparse, itertools, json, mmap, os, re, struct, subprocess, sys, threading, time
+from array import array
 from dataclasses import dataclass
 from typing import List, Optional, Tuple, Dict
 
@@ -10,6 +11,7 @@ import matplotlib.pyplot as plt
 from matplotlib.animation import FuncAnimation
 
 TICK_MS_DEFAULT = 10
+MAX_FRAMES = 600   # queue animation length; also how many tick events are kept
 
 JSON_RECOMMENDED = """
 (Optional) Add a JSON line per tick in your C code for richer parsing, e.g.:
@@ -17,8 +19,13 @@ printf("{\"t\":%d,\"pid\":%d,\"name\":\"%s\",\"queue\":\"%s\",\"work_left\":%d,\
        tick, p->pid, p->name, qname, p->work_left, p->ticks_left);
 """
 
-HUMAN_LINE = re.compile(r"Process\s+(?P<name>\S+)\s+(?P<pid>\d+)\s+has\s+consumed\s+(?P<ms>\d+)\s+ms\s+in\s+(?P<queue>\S+)", re.IGNORECASE)
+HUMAN_LINE = re.compile(r"Process\s+(?P<name>\S+)\s+(?P<pid>\d+)\s+has\s+consumed\s+(?P<ms>\d+)\s+ms\s+in\s+(?P<queue>\S+)(?:\s+on\s+cpu\s+(?P<cpu>\d+))?", re.IGNORECASE)
 EXIT_LINE = re.compile(r"Process\s+(?P<name>\S+)\s+(?P<pid>\d+)\s+EXIT", re.IGNORECASE)
+# Queue operations logged with --qtrace:
+#   Q+ <pid> <q>   Q- <pid> <q>   Qv <pid> <from> <to>   Q~ <q1> <q2>
+QUEUE_LINE = re.compile(r"^Q(?P<op>[+\-v~])\s+(?P<a>\S+)\s+(?P<b>\S+)(?:\s+(?P<c>\S+))?")
+
+QueueOp = Tuple[str, int, str, str]
 
 @dataclass
 class TickEvent:
@@ -30,86 +37,248 @@ class TickEvent:
     work_left: Optional[int] = None
     ticks_left: Optional[int] = None
 
-def parse_stdout(stdout: str, tick_ms: int, mode: str = "o1") -> Tuple[List[TickEvent], Dict[int,int]]:
-    events: List[TickEvent] = []
-    t = 0
-    exit_tick: Dict[int,int] = {}
-    def map_queue(q: str) -> str:
-        q = q.upper()
-        if mode == "mlfq":
-            if q in ("L0","HIGH","Q0"): return "FQ"
-            if q in ("L1","MID","Q1"): return "AQ"
-            if q in ("L2","LOW","Q2"): return "EQ"
-        return q
-    for line in stdout.splitlines():
+def map_queue(q: str, mode: str) -> str:
+    q = q.upper()
+    if mode == "mlfq":
+        if q in ("L0","HIGH","Q0"): return "FQ"
+        if q in ("L1","MID","Q1"): return "AQ"
+        if q in ("L2","LOW","Q2"): return "EQ"
+    return q
+
+class GanttBins:
+    """Level-of-detail timeline: per-pid, per-queue busy ticks in fixed bins.
+
+    There are ``nbins`` bins (about one per output pixel). Whenever the trace
+    outgrows them, neighbouring bins are merged and the bin width doubles, so
+    memory and drawing cost depend on the image resolution and the number of
+    pids, never on the length of the trace.
+    """
+    CLASSES = ("FQ", "AQ", "EQ")
+
+    def __init__(self, nbins: int = 1800):
+        self.nbins = nbins + (nbins & 1)
+        self.width = 1  # ticks per bin
+        self.rows: Dict[int, List[array]] = {}
+
+    def _grow(self, end: int):
+        while end > self.nbins * self.width:
+            half = self.nbins // 2
+            for row in self.rows.values():
+                for a in row:
+                    for i in range(half): a[i] = a[2*i] + a[2*i+1]
+                    for i in range(half, self.nbins): a[i] = 0
+            self.width *= 2
+
+    def add(self, pid: int, queue: str, ts: int, te: int):
+        k = self.CLASSES.index(queue) if queue in self.CLASSES else 0
+        self._grow(te)
+        row = self.rows.get(pid)
+        if row is None:
+            row = self.rows[pid] = [array("L", [0]) * self.nbins for _ in self.CLASSES]
+        a, w = row[k], self.width
+        while ts < te:
+            b = ts // w
+            n = min(te, (b + 1) * w) - ts
+            a[b] += n; ts += n
+
+    def runs(self, pid: int):
+        """Yield (class, start_tick, end_tick) for runs of bins with the same
+        dominant queue class (ties go to the higher queue)."""
+        fq, aq, eq = self.rows[pid]; w = self.width
+        cur = -1; start = 0
+        for b in range(self.nbins):
+            f, a, e = fq[b], aq[b], eq[b]
+            k = -1 if f + a + e == 0 else (0 if f >= a and f >= e else (1 if a >= e else 2))
+            if k != cur:
+                if cur >= 0: yield cur, start * w, b * w
+                cur, start = k, b
+        if cur >= 0: yield cur, start * w, self.nbins * w
+
+class TraceStream:
+    """Incremental trace parser.
+
+    Lines are fed one at a time; per-pid timeline slices are built on the fly
+    and only the first ``keep_events`` tick events are retained (for the queue
+    animation), so memory is bounded by the plotted window rather than by the
+    length of the simulator's output. ``feed()`` returns False once
+    ``max_ticks`` has been reached, telling the caller to stop reading.
+    """
+    def __init__(self, tick_ms: int, mode: str = "o1", max_ticks: Optional[int] = None,
+                 keep_events: Optional[int] = 600, bins: Optional[GanttBins] = None):
+        self.tick_ms = tick_ms
+        self.mode = mode
+        self.max_ticks = max_ticks
+        self.keep_events = keep_events
+        self.bins = bins  # when set, closed slices are binned instead of kept
+        self.t = 0
+        self.events: List[TickEvent] = []
+        # Queue operations (--qtrace) that preceded each kept event,
+        # as (op, pid, queue, other_queue); pid is 0 for swaps.
+        self.qdeltas: List[List[QueueOp]] = []
+        self._pending: List[QueueOp] = []
+        self.demotions = 0
+        self.swaps = 0
+        self.exit_tick: Dict[int,int] = {}
+        self.names: Dict[int,str] = {}
+        self.slices: Dict[int, List[Tuple[str,int,int]]] = {}
+        self._open: Dict[int, List] = {}   # pid -> [queue, start, end]
+        self.last_busy = -1
+        # Human-readable lines: ms each CPU has accounted so far ("on cpu N";
+        # lines without it are the only CPU, or a machine-wide tickless idle
+        # gap), and where CPUs not seen yet start.
+        self._cpu_ms: Dict[int,int] = {}
+        self._base_ms = 0
+
+    def done(self) -> bool:
+        return self.max_ticks is not None and self.t >= self.max_ticks
+
+    def _tick(self, ev: TickEvent, span: int = 1):
+        if self.keep_events is None or len(self.events) < self.keep_events:
+            self.events.append(ev)
+            self.qdeltas.append(self._pending); self._pending = []
+        if ev.queue != "IDLE":
+            self.names[ev.pid] = ev.name
+            self.last_busy = ev.t
+            cur = self._open.get(ev.pid)
+            if cur is not None and cur[0] == ev.queue and cur[2] == ev.t:
+                cur[2] = ev.t + 1
+            else:
+                if cur is not None: self._close(ev.pid, cur)
+                self._open[ev.pid] = [ev.queue, ev.t, ev.t + 1]
+        self.t = max(self.t, ev.t + span)
+
+    def feed(self, line: str) -> bool:
+        if self.done(): return False
         line = line.strip()
-        if not line: continue
+        if not line: return True
         if line.startswith("{") and line.endswith("}"):
             try:
                 obj = json.loads(line)
-                qname = map_queue(str(obj.get("queue","FQ")))
-                events.append(TickEvent(
-                    t=int(obj.get("t", t)),
+                self._tick(TickEvent(
+                    t=int(obj.get("t", self.t)),
                     pid=int(obj["pid"]),
                     name=str(obj["name"]),
-                    queue=qname,
-                    ms=int(obj.get("ms", tick_ms)),
+                    queue=map_queue(str(obj.get("queue","FQ")), self.mode),
+                    ms=int(obj.get("ms", self.tick_ms)),
                     work_left=obj.get("work_left"),
                     ticks_left=obj.get("ticks_left"),
                 ))
-                t = events[-1].t + 1
-                continue
+                return not self.done()
             except Exception:
                 pass
+        m_q = QUEUE_LINE.match(line)
+        if m_q:
+            op = m_q.group("op")
+            if op == "v": self.demotions += 1
+            elif op == "~": self.swaps += 1
+            if self.keep_events is None or len(self.events) < self.keep_events:
+                if op == "~":
+                    self._pending.append((op, 0, map_queue(m_q.group("a"), self.mode),
+                                          map_queue(m_q.group("b"), self.mode)))
+                elif op in "+-" or m_q.group("c"):
+                    other = map_queue(m_q.group("c"), self.mode) if m_q.group("c") else ""
+                    self._pending.append((op, int(m_q.group("a")), map_queue(m_q.group("b"), self.mode), other))
+            return True
         m_exit = EXIT_LINE.search(line)
         if m_exit:
             try:
-                pid = int(m_exit.group("pid"))
-                exit_tick[pid] = t
+                self.exit_tick[int(m_exit.group("pid"))] = self.t
             except Exception:
                 pass
-            continue
+            return True
         m = HUMAN_LINE.search(line)
         if m:
-            pid = int(m.group("pid"))
-            name = m.group("name")
-            queue = map_queue(m.group("queue"))
+            queue = map_queue(m.group("queue"), self.mode)
             ms = int(m.group("ms"))
-            events.append(TickEvent(t=t, pid=pid, name=name, queue=queue, ms=ms))
-            t += 1
-    return events, exit_tick
+            # Each CPU keeps its own ms clock, so the lines of all CPUs for one
+            # tick advance time once, and the parts of a tick split by a
+            # mid-tick wakeup carry their remainder into the next line.
+            # Tickless traces report a whole idle gap on one line.
+            if m.group("cpu") is None:
+                start = max(self._cpu_ms.values(), default=self._base_ms)
+                self._base_ms = start + ms
+                for cpu in self._cpu_ms: self._cpu_ms[cpu] = self._base_ms
+            else:
+                cpu = int(m.group("cpu"))
+                start = self._cpu_ms.get(cpu, self._base_ms)
+                self._cpu_ms[cpu] = start + ms
+            t = start // self.tick_ms
+            span = (start + ms) // self.tick_ms - t
+            if self.max_ticks is not None: span = min(span, self.max_ticks - t)
+            self._tick(TickEvent(t=t, pid=int(m.group("pid")), name=m.group("name"),
+                                 queue=queue, ms=ms), span)
+        return not self.done()
+
+    def _close(self, pid: int, cur: List):
+        if self.bins is not None: self.bins.add(pid, *cur)
+        else: self.slices.setdefault(pid, []).append(tuple(cur))
+
+    def finish(self) -> "TraceStream":
+        for pid, cur in self._open.items():
+            self._close(pid, cur)
+        self._open.clear()
+        return self
+
+def parse_stdout(stdout: str, tick_ms: int, mode: str = "o1") -> Tuple[List[TickEvent], Dict[int,int]]:
+    """Parse a complete trace held in memory (small runs and tests)."""
+    ts = TraceStream(tick_ms, mode, keep_events=None)
+    for line in stdout.splitlines(): ts.feed(line)
+    return ts.events, ts.exit_tick
 
 # Gantt timeline
-def make_gantt(events: List[TickEvent], out_path: str):
-    if not events: raise SystemExit("No events parsed. " + JSON_RECOMMENDED)
-    used = [e for e in events if e.queue != "IDLE"]
-    if not used: raise SystemExit("Parsed only IDLE events. " + JSON_RECOMMENDED)
-    by_pid: Dict[int, List[TickEvent]] = {}
-    for e in used: by_pid.setdefault(e.pid, []).append(e)
-    pids = sorted(by_pid.keys())
-    labels = {pid: f"{by_pid[pid][0].name} ({pid})" for pid in pids}
+GANTT_HATCH = {"FQ":"", "AQ":"//", "EQ":"xx"}
+
+def make_gantt_lod(trace: TraceStream, out_path: str):
+    """Decimated timeline: one PolyCollection per queue class."""
+    from matplotlib.collections import PolyCollection
+    import matplotlib.patches as mpatches
+    bins = trace.bins
+    tick_ms = trace.tick_ms
+    pids = sorted(bins.rows.keys())
+    fig, ax = plt.subplots(figsize=(12,4))
+    verts_by_class: List[List] = [[] for _ in GanttBins.CLASSES]
+    for i, pid in enumerate(pids):
+        y = i * 10
+        for k, ts, te in bins.runs(pid):
+            x0, x1 = ts * tick_ms, te * tick_ms
+            verts_by_class[k].append([(x0, y), (x0, y + 8), (x1, y + 8), (x1, y)])
+    for q, verts in zip(GanttBins.CLASSES, verts_by_class):
+        if verts:
+            ax.add_collection(PolyCollection(verts, facecolors="tab:blue", edgecolors="black",
+                                             linewidths=0.2, hatch=GANTT_HATCH[q] or None))
+    ax.set_ylim(0, (len(pids)+1)*10)
+    ax.set_xlim(0, (trace.last_busy+1)*tick_ms)
+    if len(pids) <= 40:
+        ax.set_yticks([i*10+4 for i in range(len(pids))])
+        ax.set_yticklabels([f"{trace.names.get(pid, 'P')} ({pid})" for pid in pids])
+    ax.set_xlabel("Time (ms)")
+    ax.set_title(f"Scheduler Timeline, {bins.width * tick_ms} ms per bin (FQ=solid, AQ=//, EQ=xx)")
+    ax.legend(handles=[mpatches.Patch(label="FQ (solid)"), mpatches.Patch(hatch="//", label="AQ (//)"), mpatches.Patch(hatch="xx", label="EQ (xx)")], loc="upper right")
+    plt.tight_layout(); plt.savefig(out_path, dpi=150); plt.close(fig)
+
+def make_gantt(trace: TraceStream, out_path: str):
+    if not trace.events: raise SystemExit("No events parsed. " + JSON_RECOMMENDED)
+    if trace.bins is not None:
+        if not trace.bins.rows: raise SystemExit("Parsed only IDLE events. " + JSON_RECOMMENDED)
+        return make_gantt_lod(trace, out_path)
+    if not trace.slices: raise SystemExit("Parsed only IDLE events. " + JSON_RECOMMENDED)
+    tick_ms = trace.tick_ms
+    pids = sorted(trace.slices.keys())
+    labels = {pid: f"{trace.names.get(pid, 'P')} ({pid})" for pid in pids}
     fig, ax = plt.subplots(figsize=(12,4))
     ymap = {pid:i for i,pid in enumerate(pids)}; yticks=[]; yticklabels=[]
     for pid in pids:
-        seq = by_pid[pid]
-        groups=[]; last_q=None; start=None; last=None
-        for e in seq:
-            if last_q==e.queue and last==e.t-1: last=e.t
-            else:
-                if last_q is not None: groups.append((last_q,start,last+1))
-                last_q=e.queue; start=e.t; last=e.t
-        if last_q is not None: groups.append((last_q,start,last+1))
         y=ymap[pid]*10; yticks.append(y+4); yticklabels.append(labels[pid])
-        for q,ts,te in groups:
-            start_ms = ts * events[0].ms
-            width_ms = (te-ts) * events[0].ms
-            hatch = {"FQ":"","AQ":"//","EQ":"xx"}.get(q,"")
+        for q,ts,te in trace.slices[pid]:
+            start_ms = ts * tick_ms
+            width_ms = (te-ts) * tick_ms
+            hatch = GANTT_HATCH.get(q,"")
             coll = ax.broken_barh([(start_ms,width_ms)], (y,8), facecolors="tab:blue", edgecolors="black")
             if hatch:
                 try: coll.set_hatch(hatch)
                 except Exception: pass
     ax.set_ylim(0,(len(pids)+1)*10)
-    ax.set_xlim(0,(max(e.t for e in used)+1)*events[0].ms)
+    ax.set_xlim(0,(trace.last_busy+1)*tick_ms)
     ax.set_yticks(yticks); ax.set_yticklabels(yticklabels)
     ax.set_xlabel("Time (ms)"); ax.set_title("Scheduler Timeline (FQ=solid, AQ=//, EQ=xx)")
     import matplotlib.patches as mpatches
@@ -117,61 +286,52 @@ def make_gantt(events: List[TickEvent], out_path: str):
     plt.tight_layout(); plt.savefig(out_path, dpi=150); plt.close(fig)
 
 # Queue animation (rows)
-def make_queue_animation(events: List[TickEvent], out_path: str, max_frames: int = 600, exit_tick: Optional[Dict[int,int]] = None):
-    from collections import deque, defaultdict
-    if exit_tick is None: exit_tick={}
+class QueueState:
+    """Queue contents rebuilt from the simulator's explicit queue operations.
+
+    Each queue is an insertion-ordered dict used as an indexed FIFO, so
+    enqueue, dequeue, removal by pid and AQ/EQ swaps are all O(1) and a frame
+    costs O(changes) plus the handful of boxes actually drawn. Demotions are
+    followed by their own enqueue, so they need no state change here.
+    """
+    def __init__(self):
+        self.queues: Dict[str, Dict[int,None]] = {"FQ": {}, "AQ": {}, "EQ": {}}
+
+    def apply(self, op: str, pid: int, queue: str, other: str = ""):
+        if op == "~":
+            qs = self.queues
+            qs[queue], qs[other] = qs.setdefault(other, {}), qs.setdefault(queue, {})
+            return
+        q = self.queues.setdefault(queue, {})
+        if op == "+": q[pid] = None
+        elif op == "-": q.pop(pid, None)
+
+    def head(self, queue: str, n: int) -> List[int]:
+        return list(itertools.islice(self.queues.get(queue, {}), n))
+
+def make_queue_animation(events: List[TickEvent], out_path: str, max_frames: int = 600,
+                         qdeltas: Optional[List[List[QueueOp]]] = None,
+                         names: Optional[Dict[int,str]] = None):
     # Names
-    pid_names: Dict[int,str]={}
+    pid_names: Dict[int,str]=dict(names or {})
     for e in events:
         if e.queue!="IDLE": pid_names[e.pid]=e.name
-    # Queues
-    FQ, AQ, EQ = deque(), deque(), deque()
-    seen=set()
-    for e in events:
-        if e.queue=="FQ" and e.pid not in seen: FQ.append(e.pid); seen.add(e.pid)
-    for e in events:
-        if e.queue=="AQ" and e.pid not in seen: AQ.append(e.pid); seen.add(e.pid)
-    for e in events:
-        if e.queue=="EQ" and e.pid not in seen: EQ.append(e.pid); seen.add(e.pid)
-
-    def purge_all(dq, pid):
-        if not dq: return
-        filtered=[x for x in dq if x!=pid]; dq.clear(); dq.extend(filtered)
-    def dedupe_all():
-        s=set()
-        def dedupe(dq):
-            out=[]
-            for x in dq:
-                if x in s: continue
-                s.add(x); out.append(x)
-            dq.clear(); dq.extend(out)
-        dedupe(FQ); dedupe(AQ); dedupe(EQ)
-
-    frames=[]; tick=0; streak=defaultdict(int); exited=set();
-    for e in events[:max_frames]:
-        dedupe_all()
-        frames.append((tick, list(FQ), list(AQ), list(EQ), e.pid if e.queue!="IDLE" else None, e.queue))
-        tick+=1
-        if e.queue=="IDLE": continue
-        if e.queue=="AQ" and not AQ and EQ: AQ, EQ = EQ, AQ
-        # Seed first time
-        # Remove pid everywhere then apply movement
-        purge_all(FQ,e.pid); purge_all(AQ,e.pid); purge_all(EQ,e.pid)
-        if e.pid in exit_tick and exit_tick[e.pid] <= tick: # finished
-            continue
-        if e.queue=="FQ":
-            streak[e.pid]=0; AQ.append(e.pid)
-        elif e.queue=="AQ":
-            streak[e.pid]+=1
-            if streak[e.pid] >= 3: streak[e.pid]=0; EQ.append(e.pid)
-            else: AQ.append(e.pid)
-        else: # EQ
-            streak[e.pid]+=1; EQ.append(e.pid)
-        dedupe_all()
-        # purge any exited by this tick
-        for pid, xt in list(exit_tick.items()):
-            if xt <= tick:
-                purge_all(FQ,pid); purge_all(AQ,pid); purge_all(EQ,pid)
+    max_items = 14
+    if not qdeltas or not any(qdeltas):
+        print("[o1viz] Trace has no queue events (run the simulator with --qtrace); showing the CPU row only.")
+        qdeltas = [[] for _ in events]
+    # Apply each frame's queue operations to the live state.
+    state = QueueState(); applied = [0]
+    def frame_at(i):
+        if i < applied[0]:  # rewound (e.g. init frame): rebuild
+            state.__init__(); applied[0] = 0
+        while applied[0] <= i:
+            for op in qdeltas[applied[0]]: state.apply(*op)
+            applied[0] += 1
+        e = events[i]
+        return (e.t, state.head("FQ", max_items), state.head("AQ", max_items), state.head("EQ", max_items),
+                e.pid if e.queue!="IDLE" else None, e.queue)
+    frames = range(min(len(events), max_frames))
 
     # Draw
     import matplotlib.patches as patches
@@ -179,7 +339,7 @@ def make_queue_animation(events: List[TickEvent], out_path: str, max_frames: int
     palette = cm.get_cmap('tab20')
     pid_list = sorted(pid_names.keys()); pid_color={pid: palette(i % palette.N) for i,pid in enumerate(pid_list)}
     fig, ax = plt.subplots(figsize=(9,4.5))
-    def draw_row(y, items, running_pid=None, label="", max_items=14):
+    def draw_row(y, items, running_pid=None, label=""):
         ax.text(-1.0, y+0.5, label, ha="right", va="center", fontsize=10, fontweight='bold')
         for i,pid in enumerate(items[:max_items]):
             face = pid_color.get(pid, (0.9,0.9,0.9,1.0))
@@ -189,7 +349,7 @@ def make_queue_animation(events: List[TickEvent], out_path: str, max_frames: int
             ax.add_patch(rect)
             ax.text(i+0.45, y+0.4, pid_names.get(pid, f"P{pid}"), ha="center", va="center", fontsize=9)
     def draw(frame):
-        tick, fq, aq, eq, running_pid, qname = frame
+        tick, fq, aq, eq, running_pid, qname = frame_at(frame)
         ax.clear(); ax.set_xlim(-1.2, 15.0); ax.set_ylim(-0.2, 4.2); ax.axis('off')
         title=f"Tick {tick}"; title += (f"  CPU: {pid_names.get(running_pid, f'P{running_pid}')} ({qname})" if running_pid is not None else "  CPU: idle")
         ax.set_title(title)
@@ -201,6 +361,205 @@ def make_queue_animation(events: List[TickEvent], out_path: str, max_frames: int
     ani.save(out_path, writer="pillow", fps=2)
     plt.close(fig)
 
+# Summary dashboard (mlfqsim --stats-out)
+def read_stats(path: str) -> Dict[str, object]:
+    """Parse the compact stats stream written by ``mlfqsim --stats-out``."""
+    st: Dict[str, object] = {"tick_ms": TICK_MS_DEFAULT, "series": [], "levels": None,
+                             "hist": {"resp": [], "turn": []}, "jobs": []}
+    with open(path) as f:
+        for line in f:
+            p = line.split()
+            if not p or p[0].startswith("#"): continue
+            if p[0] == "T":
+                st["tick_ms"], st["width"], st["ticks"], st["exited"] = (int(x) for x in p[1:5])
+            elif p[0] == "S":
+                st["series"].append((int(p[1]), int(p[2]), float(p[3]), float(p[4]), float(p[5]),
+                                     int(p[6]), int(p[7]), int(p[8]), int(p[9])))
+            elif p[0] == "L":
+                st["levels"] = [int(x) for x in p[1:5]]
+            elif p[0] == "H":
+                st["hist"][p[1]].append((int(p[2]), int(p[3]), int(p[4])))
+            elif p[0] == "J":
+                st["jobs"].append((int(p[1]), int(p[2]), int(p[3]), int(p[4])))
+    return st
+
+def make_dashboard(stats_path: str, out_path: str):
+    """Four-panel summary built from aggregated counters only, so its cost is
+    independent of how many ticks the simulation ran."""
+    st = read_stats(stats_path)
+    tick_ms = st["tick_ms"]
+    fig, axs = plt.subplots(2, 2, figsize=(12, 8))
+    ax = axs[0][0]
+    series = st["series"]
+    xs = [s[0] * tick_ms / 1000.0 for s in series]
+    for i, lv in enumerate(("L0", "L1", "L2")):
+        ax.plot(xs, [s[2 + i] for s in series], label=lv, drawstyle="steps-post")
+    ax.set_xlabel("Time (s)"); ax.set_ylabel("Mean queue length")
+    ax.set_title(f"Queue length ({st.get('width', 1) * tick_ms} ms windows)"); ax.legend(loc="upper right")
+
+    ax = axs[0][1]
+    lv = st["levels"] or [0, 0, 0, 0]
+    total = sum(lv) or 1
+    ax.bar(["L0", "L1", "L2", "idle"], [100.0 * v / total for v in lv], color=["tab:blue", "tab:orange", "tab:green", "tab:gray"])
+    ax.set_ylabel("% of CPU time"); ax.set_title("CPU share per level")
+
+    ax = axs[1][0]
+    for name, label in (("resp", "response"), ("turn", "turnaround")):
+        buckets = st["hist"][name]
+        n = sum(b[2] for b in buckets)
+        if not n: continue
+        xs, ys, seen = [], [], 0
+        for lo, hi, c in buckets:
+            seen += c; xs.append(max(hi, 1)); ys.append(seen / n)
+        ax.plot(xs, ys, drawstyle="steps-post", label=label)
+    ax.set_xscale("log"); ax.set_ylim(0, 1.01)
+    ax.set_xlabel("Time (ms)"); ax.set_ylabel("Fraction of jobs"); ax.set_title("Latency CDF"); ax.legend(loc="lower right")
+
+    ax = axs[1][1]
+    jobs = st["jobs"]
+    if jobs:
+        work = [j[1] for j in jobs]
+        slow = [j[2] / max(tick_ms * -(-j[1] // tick_ms), 1) for j in jobs]
+        ax.scatter(work, slow, s=4, alpha=0.5)
+        ax.set_xscale("log"); ax.set_yscale("log")
+    ax.set_xlabel("CPU work (ms)"); ax.set_ylabel("Slowdown (turnaround / work)")
+    ax.set_title(f"Per-job slowdown ({len(jobs)} sampled of {st.get('exited', 0)})")
+    plt.tight_layout(); plt.savefig(out_path, dpi=120); plt.close(fig)
+
+# Live monitoring through mlfqsim's shared-memory ring (--shm)
+RING_HDR = 256
+RING_REC = struct.Struct("<QIIBB6x")   # tick, pid, arg, kind, level
+RING_RUN, RING_IDLE, RING_EXIT, RING_ENQ, RING_DEQ, RING_DEMOTE = range(1, 7)
+
+class ShmRing:
+    """Consumer side of mlfqsim's single-producer/single-consumer ring.
+
+    Records are read in place: with numpy each batch is a structured-array
+    view of the mapped segment, otherwise a memoryview decoded with struct.
+    Advancing ``tail`` after a batch is processed gives the simulator room
+    to write again (it blocks while the ring is full).
+    """
+    def __init__(self, name: str, timeout: float = 10.0, proc: Optional[subprocess.Popen] = None):
+        self.path = "/dev/shm/" + name.lstrip("/")
+        self.proc = proc
+        deadline = time.time() + timeout
+        while True:
+            try:
+                if os.path.getsize(self.path) > RING_HDR:
+                    with open(self.path, "rb") as f:
+                        if f.read(8) == b"MLFQRING": break
+            except OSError:
+                pass
+            if proc is not None and proc.poll() is not None:
+                raise SystemExit(f"[o1viz] simulator exited with status {proc.returncode} before creating {self.path}")
+            if time.time() > deadline: raise SystemExit(f"[o1viz] no ring at {self.path}")
+            time.sleep(0.01)
+        self.f = open(self.path, "r+b")
+        self.mm = mmap.mmap(self.f.fileno(), 0)
+        _, _, rec_size, self.capacity = struct.unpack_from("<8sIIQ", self.mm, 0)
+        if rec_size != RING_REC.size: raise SystemExit("[o1viz] ring record size mismatch")
+        try:
+            import numpy as np
+            dtype = np.dtype([("tick", "<u8"), ("pid", "<u4"), ("arg", "<u4"),
+                              ("kind", "u1"), ("level", "u1"), ("pad", "V6")])
+            self.recs = np.frombuffer(self.mm, dtype=dtype, count=self.capacity, offset=RING_HDR)
+        except ImportError:
+            self.recs = None
+
+    def _head(self) -> int: return struct.unpack_from("<Q", self.mm, 64)[0]
+    def _done(self) -> bool: return struct.unpack_from("<I", self.mm, 72)[0] != 0
+    def _tail(self) -> int: return struct.unpack_from("<Q", self.mm, 128)[0]
+
+    def batches(self):
+        """Yield contiguous batches of records until the producer is done, or
+        has exited (crashed, say) without marking the ring done."""
+        while True:
+            # Read done, and whether the producer is gone, before head so
+            # nothing it wrote last is missed.
+            done = self._done() or (self.proc is not None and self.proc.poll() is not None)
+            head, tail = self._head(), self._tail()
+            if head == tail:
+                if done: return
+                time.sleep(0.001); continue
+            i0 = tail % self.capacity
+            n = min(head - tail, self.capacity - i0)
+            if self.recs is not None:
+                yield self.recs[i0:i0 + n]
+            else:
+                off = RING_HDR + i0 * RING_REC.size
+                yield list(RING_REC.iter_unpack(self.mm[off:off + n * RING_REC.size]))
+            struct.pack_into("<Q", self.mm, 128, tail + n)
+
+    def close(self, unlink: bool = True):
+        if self.recs is not None: del self.recs
+        self.mm.close(); self.f.close()
+        if unlink:
+            try: os.unlink(self.path)
+            except OSError: pass
+
+class RingMonitor:
+    """Aggregates ring batches into running totals and prints a status line
+    about once per second."""
+    def __init__(self, tick_ms: int):
+        self.tick_ms = tick_ms
+        self.level = [0, 0, 0]; self.idle = 0; self.exits = 0; self.demotions = 0
+        self.tick = 0; self.records = 0
+        self.t0 = self.last = time.time()
+
+    def add(self, batch):
+        self.records += len(batch)
+        if hasattr(batch, "dtype"):
+            import numpy as np
+            kind = batch["kind"]
+            run = kind == RING_RUN
+            self.level = [a + int(b) for a, b in zip(self.level, np.bincount(batch["level"][run], minlength=3)[:3])]
+            self.idle += int(batch["arg"][kind == RING_IDLE].sum())
+            self.exits += int(np.count_nonzero(kind == RING_EXIT))
+            self.demotions += int(np.count_nonzero(kind == RING_DEMOTE))
+            if len(batch): self.tick = int(batch["tick"][-1])
+        else:
+            for tick, pid, arg, kind, level in batch:
+                if kind == RING_RUN: self.level[level] += 1
+                elif kind == RING_IDLE: self.idle += arg
+                elif kind == RING_EXIT: self.exits += 1
+                elif kind == RING_DEMOTE: self.demotions += 1
+                self.tick = tick
+        now = time.time()
+        if now - self.last >= 1.0:
+            self.report(); self.last = now
+
+    def report(self, final: bool = False):
+        busy = sum(self.level); total = busy + self.idle or 1
+        wall = max(time.time() - self.t0, 1e-9)
+        share = " ".join(f"L{i} {100.0 * v / total:.1f}%" for i, v in enumerate(self.level))
+        print(f"[o1viz] {'final' if final else 'live'}: t={self.tick * self.tick_ms} ms "
+              f"{self.records / wall:,.0f} rec/s busy {100.0 * busy / total:.1f}% ({share}) "
+              f"exits {self.exits} demotions {self.demotions}", flush=True)
+
+def monitor_shm(binary: str, cmdline: str, name: str, tick_ms: int, sim_args: Optional[List[str]] = None):
+    argv = [binary, "--quiet", "--shm", name] + list(sim_args or []) + [cmdline]
+    print(f"[o1viz] Running: {' '.join(argv[:-1])} {cmdline!r}")
+    try: os.unlink("/dev/shm/" + name.lstrip("/"))  # never attach to a stale ring
+    except OSError: pass
+    proc = subprocess.Popen(argv, stdout=subprocess.DEVNULL)
+    try:
+        ring = ShmRing(name, proc=proc)
+    except SystemExit:
+        proc.kill(); proc.wait()
+        raise
+    mon = RingMonitor(tick_ms)
+    batch = None
+    try:
+        for batch in ring.batches(): mon.add(batch)
+    finally:
+        del batch  # a numpy batch is a view; the mapping cannot close under it
+        ring.close()
+        rc = proc.wait()
+    mon.report(final=True)
+    if rc != 0:
+        print(f"[o1viz] simulator exited with status {rc}")
+        sys.exit(1)
+
 def try_build(binary: str, c_file: str, extra_cflags: List[str]):
     if os.path.exists("Makefile"):
         print("[o1viz] Running make...")
@@ -216,10 +575,38 @@ def try_build(binary: str, c_file: str, extra_cflags: List[str]):
     cmd=["gcc","-O2","-Wall","-Wextra","-o",binary,c_file]+extra_cflags
     subprocess.check_call(cmd)
 
-def run_program(binary: str, cmdline: str) -> str:
-    print(f"[o1viz] Running: {binary} {cmdline!r}")
-    proc = subprocess.run([binary, cmdline], capture_output=True, text=True, check=True)
-    return proc.stdout
+def run_program(binary: str, cmdline: str, trace: TraceStream, sim_args: Optional[List[str]] = None) -> TraceStream:
+    """Run the simulator and feed its stdout into ``trace`` line by line.
+
+    Reading stops as soon as the trace has covered its tick window; the child
+    is then terminated, so long runs never buffer their full output.
+    """
+    argv = [binary] + list(sim_args or []) + [cmdline]
+    print(f"[o1viz] Running: {' '.join(argv[:-1])} {cmdline!r}")
+    proc = subprocess.Popen(argv, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                            text=True, bufsize=1 << 16)
+    # Drain stderr alongside stdout: --stats or --progress output larger than
+    # a pipe buffer would otherwise block the simulator and hang both sides.
+    err_parts: List[str] = []
+    err_reader = threading.Thread(target=lambda: err_parts.append(proc.stderr.read()), daemon=True)
+    err_reader.start()
+    stopped = False
+    try:
+        for line in proc.stdout:
+            if not trace.feed(line):
+                stopped = True
+                break
+    finally:
+        if stopped:
+            proc.terminate()
+        proc.stdout.close()
+        rc = proc.wait()
+        err_reader.join()
+        proc.stderr.close()
+        err = "".join(err_parts)
+    if not stopped and rc != 0:
+        raise subprocess.CalledProcessError(rc, argv, stderr=err)
+    return trace.finish()
 
 def main():
     ap = argparse.ArgumentParser(description="Visualizer for xv6-like scheduler sims")
@@ -233,36 +620,54 @@ def main():
     ap.add_argument("--max-ms", type=int, default=None)
     ap.add_argument("--max-ticks", type=int, default=None)
     ap.add_argument("--mode", choices=["o1","mlfq"], default="o1")
+    ap.add_argument("--dashboard", metavar="STATS",
+                    help="render a summary dashboard from an mlfqsim --stats-out file and exit")
+    ap.add_argument("--out-dashboard", default="dashboard.png")
+    ap.add_argument("--shm", metavar="NAME",
+                    help="live-monitor the simulator through a shared-memory ring instead of parsing stdout")
+    ap.add_argument("--lod", action="store_true",
+                    help="decimated timeline: bin into pixel-width buckets (for long traces)")
+    ap.add_argument("--sim-arg", action="append", default=[],
+                    help="extra simulator option, e.g. --sim-arg=--qtrace (repeatable)")
     args = ap.parse_args()
 
+    if args.dashboard:
+        make_dashboard(args.dashboard, args.out_dashboard); print(f"[o1viz] Wrote {args.out_dashboard}")
+        return
+
     try:
         try_build(args.bin, args.src, args.cflags)
     except Exception as e:
         print("[o1viz] Build failed:", e)
         sys.exit(1)
 
+    if args.shm:
+        monitor_shm(args.bin, args.cmd, args.shm, args.tick_ms, args.sim_arg)
+        return
+
+    max_ticks=None
+    if args.max_ticks is not None: max_ticks=max(0,int(args.max_ticks))
+    elif args.max_ms is not None: max_ticks=max(0,int(args.max_ms//args.tick_ms))
+
+    bins = GanttBins(nbins=12 * 150) if args.lod else None  # figure width in pixels
+    trace = TraceStream(args.tick_ms, mode=args.mode, max_ticks=max_ticks, keep_events=MAX_FRAMES, bins=bins)
     try:
-        stdout = run_program(args.bin, args.cmd)
+        run_program(args.bin, args.cmd, trace, args.sim_arg)
     except subprocess.CalledProcessError as e:
-        print("[o1viz] Program run failed:\n", e.stdout, e.stderr)
+        print("[o1viz] Program run failed:\n", e.stderr)
         sys.exit(1)
 
-    events, exit_tick = parse_stdout(stdout, args.tick_ms, mode=args.mode)
-    if not events:
+    if not trace.events:
         print("[o1viz] No events parsed from stdout.")
         print("Expected lines like: Process spin 1 has consumed 10 ms in FQ")
         print(JSON_RECOMMENDED); sys.exit(1)
+    if trace.done():
+        print(f"[o1viz] Stopped after {max_ticks} ticks (~{max_ticks*args.tick_ms} ms)")
 
-    max_ticks=None
-    if args.max_ticks is not None: max_ticks=max(0,int(args.max_ticks))
-    elif args.max_ms is not None: max_ticks=max(0,int(args.max_ms//args.tick_ms))
-    if max_ticks is not None and len(events)>max_ticks:
-        events=events[:max_ticks]
-        print(f"[o1viz] Trimmed to first {max_ticks} ticks (~{max_ticks*args.tick_ms} ms)")
-
-    print(f"[o1viz] Parsed {len(events)} tick events.")
-    make_gantt(events, args.out_gantt); print(f"[o1viz] Wrote {args.out_gantt}")
-    make_queue_animation(events, args.out_queues, exit_tick=exit_tick); print(f"[o1viz] Wrote {args.out_queues}")
+    print(f"[o1viz] Parsed {trace.t} ticks.")
+    make_gantt(trace, args.out_gantt); print(f"[o1viz] Wrote {args.out_gantt}")
+    make_queue_animation(trace.events, args.out_queues, max_frames=MAX_FRAMES,
+                         qdeltas=trace.qdeltas, names=trace.names); print(f"[o1viz] Wrote {args.out_queues}")
 
 if __name__ == "__main__":
     main()